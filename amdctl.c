@@ -15,19 +15,48 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <getopt.h>
+#include <ctype.h>
+#include <errno.h>
+#include <cpuid.h>
 #include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 
+#define MSR_TSC                  0x00000010
+#define MSR_MPERF                0x000000e7
+#define MSR_APERF                0x000000e8
+#define MSR_HWCR                 0xc0010015
 #define MSR_PSTATE_CURRENT_LIMIT 0xc0010061
+#define MSR_PSTATE_CTL           0xc0010062
 #define MSR_PSTATE_STATUS        0xc0010063
 #define MSR_PSTATE_BASE          0xc0010064
 #define MSR_COFVID_STATUS        0xc0010071
+#define MSR_PMGT_MISC            0xc0010292
+#define MSR_HW_PSTATE_STATUS     0xc0010293
+#define MSR_CSTATE_CONFIG        0xc0010296
+#define MSR_RAPL_PWR_UNIT        0xc0010299
+#define MSR_PKG_ENERGY_STAT      0xc001029b
+#define MSR_CPPC_CAP1            0xc00102b0
+#define MSR_CPPC_ENABLE          0xc00102b1
+#define MSR_CPPC_REQ             0xc00102b3
 
 /* BIOS and Kernel Developer’s Guide (BKDG) For AMD Family 10h Processors
  * https://web.archive.org/web/20211030021345/https://www.amd.com/system/files/TechDocs/31116.pdf
@@ -85,6 +114,67 @@
 #define PSTATE_MAX_VAL_BITS   "6:4"
 #define CUR_PSTATE_LIMIT_BITS "2:0"
 #define CUR_PSTATE_BITS       "2:0"
+#define CPB_DIS_BITS          "25:25"
+#define PSTATE_CMD_BITS       "2:0"
+#define COFVID_CUR_PSTATE_BITS "18:16"
+#define PC6_EN_BITS           "32:32"
+#define RAPL_ENERGY_UNIT_BITS "12:8"
+#define PKG_ENERGY_BITS       "31:0"
+
+// Kernel perf PMUs used by --monitor instead of the MSR devices.
+#define PERF_PMU_DIR "/sys/bus/event_source/devices"
+// APERF, MPERF and TSC, in --monitor counter group order.
+#define MONITOR_COUNTERS 3
+
+// 17h / 19h CC6 is enabled when the CCR2, CCR1 and CCR0 C-state action fields all enable it.
+static const char *CC6_EN_BITS[] = {"22:22", "14:14", "6:6"};
+
+// Collaborative processor performance control (CPPC), Zen 2 and later.
+#define CPPC_CPUID_BIT      27 // CPUID 8000_0008h EBX.
+#define CPPC_EN_BITS        "0:0"
+#define CPPC_HIGHEST_BITS   "31:24"
+#define CPPC_NOMINAL_BITS   "23:16"
+#define CPPC_NONLINEAR_BITS "15:8"
+#define CPPC_LOWEST_BITS    "7:0"
+enum {
+	CPPC_MAX,
+	CPPC_MIN,
+	CPPC_DESIRED,
+	CPPC_EPP,
+	CPPC_FIELDS,
+};
+static const char *CPPC_REQ_BITS[] = {"7:0", "15:8", "23:16", "31:24"};
+static const char *CPPC_REQ_NAMES[] = {"Max", "Min", "Desired", "EPP"};
+
+#define WAKE_SAMPLES  500
+#define WAKE_SLEEP_NS 1000000
+
+#define TRANSITION_SAMPLES    2000
+#define TRANSITION_TIMEOUT_NS 10000000
+
+// --stats phases, register accesses are counted in their own phase, not the one they happen in.
+enum {
+	PHASE_DETECT,
+	PHASE_PERMISSIONS,
+	PHASE_READS,
+	PHASE_WRITES,
+	PHASE_PCI,
+	PHASE_NB,
+	PHASE_OUTPUT,
+	PHASES,
+};
+static const char *PHASE_NAMES[] = {"Detection", "Permission check", "MSR reads", "MSR writes", "PCI / SMN access", "NB states", "Decoding / output"};
+// Per-core MSR latency histogram buckets, [0, 1us) then doubling up to [512us, inf).
+#define STATS_BUCKETS 11
+// A core is an outlier when its mean MSR latency is this many times the median of the core means.
+#define STATS_OUTLIER 2
+
+#define PERTURB_DURATION_NS 500000000
+#define PERTURB_ACCESSES    5000
+#define PERTURB_GAP_NS      1000
+// --stdin responses queued until the coalesced writes are done.
+#define COMMAND_QUEUE   256
+#define COMMAND_LINE    4096
 
 #define MAX_VOLTAGE  1550
 #define MID_VOLTAGE  1162.5
@@ -108,15 +198,255 @@ static char *IDD_VALUE_BITS = "39:32";
 #define COFVID_MIN_VID_BITS      "48:42"
 #define COFVID_MAX_VID_BITS      "41:35"
 #define ADDR_CLOCK_POWER_CONTROL "18.3"
+// 15h / 16h boost P-States come before the software P-State 0.
+#define ADDR_CPB_CONTROL         "18.4"
+#define NUM_BOOST_STATES_BITS    "4:2"
 #define MAIN_PLL_OP_FREQ_ID_BITS "5:0"
 static const unsigned char REG_CLOCK_POWER_CONTROL =  0xd4;
+static const unsigned short REG_CPB_CONTROL        =  0x15c;
 static unsigned char       COFVID_MAX_VID          =  1;
 static unsigned char       COFVID_MIN_VID          =  128;
 static signed char         MAIN_PLL_COFF           = -1;
 
+// 17h / 19h system management unit (SMU), reached through the SMN index / data registers of the root complex.
+#define ADDR_ROOT_COMPLEX  "00.0"
+#define SMN_INDEX_REG      0x60
+#define SMN_DATA_REG       0x64
+#define SMU_ARGS           6
+#define SMU_TIMEOUT_NS     1000000000
+#define SMU_RSP_OK         0x01
+// Failure responses are 0xfc (busy) to 0xff (failed), anything else is not from the SMU.
+#define SMU_RSP_FAILURES   0xfc
+// The start of the power table is mapped, from the page it is in.
+#define PM_TABLE_PAGE      0x1000
+#define PM_TABLE_MAP       0x2000
+// Power table address the --smu-sim SMU reports, an offset into --mem-dev.
+#define SMU_SIM_TABLE      0x1000
+enum {
+	LIMIT_PPT,
+	LIMIT_TDC,
+	LIMIT_EDC,
+	LIMITS,
+};
+static const char *LIMIT_NAMES[] = {"PPT", "TDC", "EDC"};
+static const char *LIMIT_UNITS[] = {"W", "A", "A"};
+
+// Mailbox registers, message IDs and power table offsets (limit, value follows) of the supported SMU firmwares.
+typedef struct {
+	unsigned char family;
+	unsigned char model;
+	const char *name;
+	uint32_t cmdReg;
+	uint32_t rspReg;
+	uint32_t argReg;
+	unsigned char setLimit[LIMITS];
+	unsigned char tableBase;
+	unsigned char tableToDram;
+	unsigned short tableOffset[LIMITS];
+} smuMailbox;
+static const smuMailbox SMU_MAILBOXES[] = {
+	{AMD17H, 0x71, "Matisse", 0x03b10524, 0x03b10570, 0x03b10a40, {0x53, 0x54, 0x55}, 0x06, 0x05, {0x00, 0x08, 0x20}},
+	{AMD19H, 0x21, "Vermeer", 0x03b10524, 0x03b10570, 0x03b10a40, {0x53, 0x54, 0x55}, 0x06, 0x05, {0x00, 0x08, 0x20}},
+};
+
+// Columns which can be selected with --fields, in display order.
+#define FIELD_CORE   0x0001
+#define FIELD_PSTATE 0x0002
+#define FIELD_STATUS 0x0004
+#define FIELD_FID    0x0008
+#define FIELD_DID    0x0010
+#define FIELD_VID    0x0020
+#define FIELD_MULT   0x0040
+#define FIELD_FREQ   0x0080
+#define FIELD_VOLT   0x0100
+#define FIELD_IDDVAL 0x0200
+#define FIELD_IDDDIV 0x0400
+#define FIELD_CURR   0x0800
+#define FIELD_POWER  0x1000
+#define FIELD_NBVID  0x2000
+#define FIELD_NBVOLT 0x4000
+#define FIELDS_DEFAULT (0x7fff & ~FIELD_CORE)
+// Fields which need a P-State (or COFVID status) register to be read.
+#define FIELDS_PSTATE_REG (0x7fff & ~(FIELD_CORE | FIELD_PSTATE))
+#define FIELDS_COFVID_REG (FIELD_FID | FIELD_DID | FIELD_VID | FIELD_MULT | FIELD_FREQ | FIELD_VOLT | FIELD_NBVID | FIELD_NBVOLT)
+#define FIELDS_IDD        (FIELD_IDDVAL | FIELD_IDDDIV | FIELD_CURR | FIELD_POWER)
+
+static const struct {
+	const char *name;
+	const char *header;
+	unsigned short field;
+} FIELD_LIST[] = {
+	{"core",   "  Core ",      FIELD_CORE},
+	{"pstate", " Pstate",      FIELD_PSTATE},
+	{"status", " Status",      FIELD_STATUS},
+	{"fid",    " CpuFid",      FIELD_FID},
+	{"did",    " CpuDid",      FIELD_DID},
+	{"vid",    " CpuVid",      FIELD_VID},
+	{"mult",   "  CpuMult",    FIELD_MULT},
+	{"mhz",    "     CpuFreq", FIELD_FREQ},
+	{"mv",     " CpuVolt",     FIELD_VOLT},
+	{"iddval", " IddVal",      FIELD_IDDVAL},
+	{"idddiv", " IddDiv",      FIELD_IDDDIV},
+	{"amps",   " CpuCurr",     FIELD_CURR},
+	{"watts",  " CpuPower",    FIELD_POWER},
+	{"nbvid",  " NbVid",       FIELD_NBVID},
+	{"nbmv",   " NbVolt",      FIELD_NBVOLT},
+};
+
+// Long options without a short equivalent.
+enum {
+	OPT_FIELDS = 256,
+	OPT_SUMMARY,
+	OPT_CC6,
+	OPT_PC6,
+	OPT_WAKE_LATENCY,
+	OPT_CCX,
+	OPT_CCD,
+	OPT_SOCKET,
+	OPT_POLL,
+	OPT_SAMPLES,
+	OPT_TRANSITION_LATENCY,
+	OPT_NO_URING,
+	OPT_MSR_DIR,
+	OPT_BENCH,
+	OPT_PERTURBATION,
+	OPT_BUDGET,
+	OPT_WATCH,
+	OPT_POWER_LIMITS,
+	OPT_PPT,
+	OPT_TDC,
+	OPT_EDC,
+	OPT_PCI_DIR,
+	OPT_MEM_DEV,
+	OPT_CPPC,
+	OPT_MAX_PERF,
+	OPT_MIN_PERF,
+	OPT_DESIRED_PERF,
+	OPT_EPP,
+	OPT_STATS,
+	OPT_STDIN,
+	OPT_MONITOR,
+	OPT_NO_PERF,
+	OPT_SMU_SIM,
+	OPT_FORCE_SMN,
+};
+
+static const struct option LONG_OPTS[] = {
+	{"fields", required_argument, NULL, OPT_FIELDS},
+	{"summary", no_argument, NULL, OPT_SUMMARY},
+	{"cc6", required_argument, NULL, OPT_CC6},
+	{"pc6", required_argument, NULL, OPT_PC6},
+	{"wake-latency", no_argument, NULL, OPT_WAKE_LATENCY},
+	{"ccx", required_argument, NULL, OPT_CCX},
+	{"ccd", required_argument, NULL, OPT_CCD},
+	{"socket", required_argument, NULL, OPT_SOCKET},
+	{"poll", required_argument, NULL, OPT_POLL},
+	{"samples", required_argument, NULL, OPT_SAMPLES},
+	{"transition-latency", no_argument, NULL, OPT_TRANSITION_LATENCY},
+	{"no-io-uring", no_argument, NULL, OPT_NO_URING},
+	{"msr-dir", required_argument, NULL, OPT_MSR_DIR},
+	{"bench", required_argument, NULL, OPT_BENCH},
+	{"perturbation", no_argument, NULL, OPT_PERTURBATION},
+	{"budget", required_argument, NULL, OPT_BUDGET},
+	{"watch", required_argument, NULL, OPT_WATCH},
+	{"power-limits", no_argument, NULL, OPT_POWER_LIMITS},
+	{"ppt", required_argument, NULL, OPT_PPT},
+	{"tdc", required_argument, NULL, OPT_TDC},
+	{"edc", required_argument, NULL, OPT_EDC},
+	{"pci-dir", required_argument, NULL, OPT_PCI_DIR},
+	{"mem-dev", required_argument, NULL, OPT_MEM_DEV},
+	{"cppc", no_argument, NULL, OPT_CPPC},
+	{"max-perf", required_argument, NULL, OPT_MAX_PERF},
+	{"min-perf", required_argument, NULL, OPT_MIN_PERF},
+	{"desired-perf", required_argument, NULL, OPT_DESIRED_PERF},
+	{"epp", required_argument, NULL, OPT_EPP},
+	{"stats", no_argument, NULL, OPT_STATS},
+	{"stdin", no_argument, NULL, OPT_STDIN},
+	{"monitor", required_argument, NULL, OPT_MONITOR},
+	{"no-perf", no_argument, NULL, OPT_NO_PERF},
+	{"smu-sim", required_argument, NULL, OPT_SMU_SIM},
+	{"force-smn", no_argument, NULL, OPT_FORCE_SMN},
+	{NULL, 0, NULL, 0}
+};
+
+// A --stdin command, also used for its queued response.
+typedef struct {
+	unsigned int line;
+	const char *error;
+	short core;
+	signed char pstate;
+	short values[5]; // -a, -n, -v, -f and -d, in COMMAND_OPTS order, -1 when not set.
+	unsigned char write;
+	uint64_t value;
+} command;
+static const char COMMAND_OPTS[] = "anvfd";
+
+// Cores with identical P-State register contents, used by --summary.
+#define MAX_PSTATES 8
+typedef struct {
+	uint64_t regs[MAX_PSTATES + 1]; // Limit register followed by the P-State registers.
+	uint64_t hash;
+	unsigned short members;
+	unsigned short rangeCount;
+	unsigned short rangeSize;
+	unsigned short (*ranges)[2];
+} pstateGroup;
+
+// Core complexes which -g output and writes can be applied to as a unit.
+enum {
+	UNIT_NONE,
+	UNIT_CCX,
+	UNIT_CCD,
+	UNIT_SOCKET,
+};
+static const char *UNIT_NAMES[] = {"", "CCX", "CCD", "Socket"};
+static const char *UNIT_OPTS[] = {"", "ccx", "ccd", "socket"};
+
+// Registers read by batchReadMsrs(), values are indexed by (core - firstCore) * count + register.
+#define MAX_BATCH_REGS 16
+#define URING_ENTRIES  256
+static struct {
+	uint32_t regs[MAX_BATCH_REGS];
+	unsigned char count;
+	short firstCore;
+	uint64_t *values;
+} msrCache = {{0}, 0, 0, NULL};
+
+// io_uring used by batchReadMsrs(), set up on first use and kept for the life of the process.
+// The MSR devices are registered as fixed files indexed by core, msrCache.values as fixed buffer.
+static struct {
+	int fd; // -1 before setup, -2 when io_uring can not be used.
+	unsigned int entries, sqMask, cqMask;
+	unsigned int *sqHead, *sqTail, *sqArray, *cqHead, *cqTail;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned char *registered;
+} uring = {-1, 0, 0, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL};
+
 static uint64_t buffer;
-static unsigned char currentOnly = 0, debug = 0, DIDS = 5, quiet = 0, PSTATES = 8, pvi = 0, testMode = 0;
-static signed char cpuDid = -1, togglePs = -1;
+static unsigned short fields = FIELDS_DEFAULT;
+static unsigned char currentOnly = 0, customFields = 0, debug = 0, summary = 0, transitionLatency = 0, wakeLatency = 0, DIDS = 5, quiet = 0, PSTATES = 8, pvi = 0, testMode = 0;
+static signed char boost = -1, cc6 = -1, cpuDid = -1, pc6 = -1, togglePs = -1;
+static unsigned char unitType = UNIT_NONE, *selectedCores = NULL;
+static unsigned short unitCount = 0, *unitOf = NULL;
+static signed short unitId = -1;
+static unsigned int benchSweeps = 0, monitorInterval = 0, pollInterval = 0, pollSamples = 0;
+static unsigned char usePerf = 1;
+static unsigned char measurePerturb = 0, useUring = 1;
+static unsigned int msrBudget = 0, skippedReads = 0, watchInterval = 0;
+static unsigned char *watchedPstates = NULL;
+static const char *msrDir = "/dev/cpu", *pciDir = "/proc/bus/pci", *memDev = "/dev/mem", *smuSim = NULL;
+static unsigned char powerLimits = 0, forceSmn = 0, cppc = 0;
+static short cppcRequest[CPPC_FIELDS] = {-1, -1, -1, -1};
+static unsigned char commandMode = 0, stats = 0, statsPhase = PHASE_DETECT;
+static uint64_t statsMark, phaseNs[PHASES];
+static unsigned int phaseCount[PHASES];
+static struct {
+	unsigned int count;
+	uint64_t total, max;
+	unsigned int buckets[STATS_BUCKETS];
+} *coreStats = NULL;
+static int newLimits[LIMITS] = {-1, -1, -1};
 static signed short core = -1, cores = 0, cpuFamily = 0, cpuFid = -1, cpuModel = -1, cpuVid = -1, nbVid = -1, pstate = -1;
 
 void getCpuInfo();
@@ -124,13 +454,72 @@ void checkFamily();
 void parseOpts(const int, char **);
 void usage();
 void fieldDescriptions();
+void parseFields(char *);
+long parseNumber(const char *, const long, const long);
+unsigned int parseCount(const char *, const int, const char *);
+int fidLimit();
+void runCommands();
+char *readCommandLine(const unsigned char);
+void parseCommand(char *, command *);
+void flushCommands(command *, unsigned int *);
 void uwmsrCheck(const unsigned char);
+void getTopology();
+int *readApicIds();
+signed char ccdApicShift();
+int readSysfsInt(const char *);
+int physicalCore(const short);
+void selectUnit(const unsigned short);
+short nextCore(const short);
+unsigned short selectedCount();
+void printCoreList();
+void applyToCores();
+void setBoost();
+void sampleEffectiveFreqs(float *);
+unsigned char boostStates();
+void setCStates();
+void setCppc();
+unsigned char getCc6();
+void measureWakeLatency(const char *);
+void latencyStats(uint64_t *, const unsigned int, uint64_t *);
+uint64_t monotonicNs();
+unsigned char statsEnter(const unsigned char);
+void statsLeave(const unsigned char, const short, const unsigned int);
+void printStats();
+void measureTransitions();
+unsigned char waitForPstate(const unsigned char, const uint64_t, uint64_t *);
 void wrCpuStates();
+uint32_t currentStateReg();
+void pollCurrentStates();
+void monitorCores();
+int perfEvent(const char *, const char *, const short, const int, double *);
+void summarizeCpuStates();
+void printCoreRanges(const pstateGroup *);
+void printFieldsHeader();
+void printRowPrefix(const char *, const int);
 void printCpuPstate(const unsigned char);
 void printNbStates();
 int getDec(const char *);
 void rwMsrReg(const uint32_t, const unsigned char);
+int msrFd(const short, const unsigned char);
+void batchReadMsrs(const uint32_t *, const unsigned char);
+void clearMsrCache();
+unsigned char uringReadMsrs(const uint32_t *, const unsigned char);
+unsigned char uringSetup();
+void benchmarkSweep();
+void readMsr(const short, const uint32_t, uint64_t *);
+void measurePerturbation();
+void watchDrift();
+void logTime();
+void runProbe(const short, uint64_t *);
 void rwPciReg(const char *, const uint32_t, const unsigned char);
+void smuPowerLimits();
+const smuMailbox *smuFind();
+uint32_t smnRw(const uint32_t, const uint32_t, const unsigned char);
+const char *smnDriver();
+uint32_t smuCommand(const smuMailbox *, const unsigned char, uint32_t *);
+void smuSimulate(const smuMailbox *, const unsigned char);
+unsigned char readPmTable(const smuMailbox *, float *, float *);
+void applyPstateOptions();
 void updateBuffer(const char *, const int);
 void getVidType();
 unsigned short vidTomV(const unsigned short);
@@ -141,26 +530,96 @@ float getClockSpeed(const unsigned short, const unsigned short);
 void error(const char *);
 
 int main(const int argc, char **argv) {
+	statsMark = monotonicNs();
 	getCpuInfo();
 	checkFamily();
 	parseOpts(argc, argv);
-	if (!quiet) {
+	if (commandMode) {
+		runCommands();
+		return EXIT_SUCCESS;
+	}
+	if (!quiet && !customFields) {
 		printf("Detected CPU model %xh, from family %xh with %d CPU cores (REFCLK = %dMHz ; Voltage ID Encodings: %s).\n", cpuModel, cpuFamily, cores, REFCLK, (pvi ? "PVI (parallel)" : "SVI (serial)"));
-		if (nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1) {
+		if (nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1 || boost > -1 || cc6 > -1 || pc6 > -1 || newLimits[LIMIT_PPT] > -1 || newLimits[LIMIT_TDC] > -1 || newLimits[LIMIT_EDC] > -1 || cppc) {
 			printf("Preview mode %s.\n", testMode ? "On": "OFF");
 		}
 	}
-	if (core == -1) {
-		core = 0;
+	if (unitType != UNIT_NONE) {
+		unsigned short unit;
+		for (unit = 0; unit < unitCount; unit++) {
+			if (unitId > -1 && unit != unitId) {
+				continue;
+			}
+			selectUnit(unit);
+			if (!quiet && !customFields) {
+				printf("\n%s %d: cores ", UNIT_NAMES[unitType], unit);
+				printCoreList();
+				printf("\n");
+			}
+			applyToCores();
+		}
 	} else {
-		cores = core + 1;
+		if (core == -1) {
+			core = 0;
+		} else {
+			cores = core + 1;
+		}
+		applyToCores();
+	}
+	if (stats) {
+		statsEnter(PHASE_NB);
+	}
+	if (!monitorInterval) {
+		printNbStates();
+	}
+	if (stats) {
+		statsEnter(PHASE_OUTPUT);
+	}
+	if (powerLimits || newLimits[LIMIT_PPT] > -1 || newLimits[LIMIT_TDC] > -1 || newLimits[LIMIT_EDC] > -1) {
+		smuPowerLimits();
+	}
+	if (watchInterval) {
+		watchDrift();
+	}
+	if (msrBudget && skippedReads && !quiet) {
+		printf("MSR budget of %d reads per core per second: %d reads were served from earlier values.\n", msrBudget, skippedReads);
 	}
-	wrCpuStates();
-	printNbStates();
 
 	return EXIT_SUCCESS;
 }
 
+/**
+ * Runs the requested reads / writes on the selected cores, starting at the core variable.
+ */
+void applyToCores() {
+	const short firstCore = core;
+	if (boost > -1) {
+		setBoost();
+	}
+	if (cc6 > -1 || pc6 > -1 || wakeLatency) {
+		setCStates();
+	}
+	if (cppc) {
+		setCppc();
+	}
+	if (benchSweeps) {
+		benchmarkSweep();
+	} else if (measurePerturb) {
+		measurePerturbation();
+	} else if (transitionLatency) {
+		measureTransitions();
+	} else if (monitorInterval) {
+		monitorCores();
+	} else if (pollInterval) {
+		pollCurrentStates();
+	} else if (summary) {
+		summarizeCpuStates();
+	} else {
+		wrCpuStates();
+	}
+	core = firstCore;
+}
+
 /**
  * Sets some variables with info from /proc/cpuinfo
  */
@@ -269,7 +728,7 @@ void parseOpts(const int argc, char **argv) {
 	unsigned char allowWrites = 0, opts = 0;
 	unsigned short mVolt;
 
-	while ((c = getopt(argc, argv, "eghimstxa:c:d:f:n:p:u:v:")) != -1) {
+	while ((c = getopt_long(argc, argv, "eghimstxa:b:c:d:f:n:p:u:v:", LONG_OPTS, NULL)) != -1) {
 		opts++;
 		switch (c) {
 			case 'a': // Toggle PState status.
@@ -278,6 +737,12 @@ void parseOpts(const int argc, char **argv) {
 					error("Option -a must be 1 or 0.");
 				}
 				break;
+			case 'b': // Toggle Core Performance Boost.
+				boost = atoi(optarg);
+				if (boost < 0 || boost > 1) {
+					error("Option -b must be 1 or 0.");
+				}
+				break;
 			case 'c': // CPU core to work on.
 				core = atoi(optarg);
 				if (core >= cores || core < 0) {
@@ -294,19 +759,7 @@ void parseOpts(const int argc, char **argv) {
 				break;
 			case 'f': // CPU fid to set.
 				cpuFid = atoi(optarg);
-				int maxFid;
-				switch (cpuFamily) {
-					case AMD14H:
-						maxFid = 3;
-						break;
-					case AMD17H:
-					case AMD19H:
-						maxFid = 0xc0;
-						break;
-					default:
-						maxFid = 0x2f;
-						break;
-				}
+				const int maxFid = fidLimit();
 				if (cpuFid > maxFid || cpuFid < 0) {
 					fprintf(stderr, "ERROR: Option -f must be a number 0 to %d. You supplied %d.\n", maxFid, cpuFid);
 					exit(EXIT_FAILURE);
@@ -378,6 +831,128 @@ void parseOpts(const int argc, char **argv) {
 			case 'x': // Displays description of various values.
 				fieldDescriptions();
 				break;
+			case OPT_FIELDS: // Only read / compute / print the selected columns.
+				parseFields(optarg);
+				break;
+			case OPT_SUMMARY: // Group cores with identical P-States.
+				summary = 1;
+				break;
+			case OPT_CC6: // Toggle core C6 state.
+			case OPT_PC6: // Toggle package C6 state.
+				if (cpuFamily != AMD17H && cpuFamily != AMD19H) {
+					error("C-state control is only available on 17h and 19h CPU's.");
+				}
+				if (atoi(optarg) < 0 || atoi(optarg) > 1 || !isdigit((unsigned char) optarg[0])) {
+					error(c == OPT_CC6 ? "Option --cc6 must be 1 or 0." : "Option --pc6 must be 1 or 0.");
+				}
+				*(c == OPT_CC6 ? &cc6 : &pc6) = atoi(optarg);
+				break;
+			case OPT_WAKE_LATENCY: // Measure wake-up latency of the selected cores.
+				wakeLatency = 1;
+				break;
+			case OPT_POLL: // Repeatedly print the current P-State.
+				pollInterval = parseCount(optarg, INT_MAX / 1000, "Option --poll must be a number of milliseconds from 1 to %d.");
+				break;
+			case OPT_SAMPLES: // Stop polling after this many samples.
+				pollSamples = parseCount(optarg, INT_MAX, "Option --samples must be from 1 to %d.");
+				break;
+			case OPT_TRANSITION_LATENCY: // Measure P-State transition latencies.
+				transitionLatency = 1;
+				break;
+			case OPT_NO_URING: // Always use pread for batched MSR reads.
+				useUring = 0;
+				break;
+			case OPT_MSR_DIR: // Directory holding the N/msr devices, for simulated device trees.
+				msrDir = optarg;
+				break;
+			case OPT_BENCH: // Time full register sweeps.
+				benchSweeps = parseCount(optarg, INT_MAX, "Option --bench must be from 1 to %d.");
+				break;
+			case OPT_PERTURBATION: // Measure the disturbance MSR reads cause on a core.
+				measurePerturb = 1;
+				break;
+			case OPT_BUDGET: // Max MSR reads per core per second.
+				msrBudget = parseCount(optarg, INT_MAX, "Option --budget must be from 1 to %d.");
+				break;
+			case OPT_WATCH: // Re-apply the P-State changes when they drift.
+				watchInterval = parseCount(optarg, INT_MAX / 1000, "Option --watch must be a number of seconds from 1 to %d.");
+				break;
+			case OPT_POWER_LIMITS: // Show the SMU package power limits.
+				powerLimits = 1;
+				break;
+			case OPT_PPT: // Package power limit to set, in watts.
+			case OPT_TDC: // Sustained current limit to set, in amps.
+			case OPT_EDC: // Peak current limit to set, in amps.
+				if (smuFind() == NULL) {
+					fprintf(stderr, "ERROR: Power limits are not supported on CPU model %xh from family %xh.\n", cpuModel, cpuFamily);
+					exit(EXIT_FAILURE);
+				}
+				newLimits[c - OPT_PPT] = parseNumber(optarg, 1, 1000);
+				if (newLimits[c - OPT_PPT] == -1) {
+					fprintf(stderr, "ERROR: The %s limit must be a number 1 to 1000.\n", LIMIT_NAMES[c - OPT_PPT]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_PCI_DIR: // Directory holding the PCI config space files, for simulated device trees.
+				pciDir = optarg;
+				break;
+			case OPT_MEM_DEV: // Physical memory device the SMU power table is read from.
+				memDev = optarg;
+				break;
+			case OPT_CPPC: // Show the CPPC capabilities and request.
+			case OPT_MAX_PERF: // CPPC maximum performance to request.
+			case OPT_MIN_PERF: // CPPC minimum performance to request.
+			case OPT_DESIRED_PERF: // CPPC desired performance to request, 0 lets the CPU choose.
+			case OPT_EPP: // CPPC energy performance preference to request, 0 is performance, 255 energy saving.
+				{
+					unsigned int eax, ebx, ecx, edx;
+					if ((cpuFamily != AMD17H && cpuFamily != AMD19H) || !__get_cpuid(0x80000008, &eax, &ebx, &ecx, &edx) || !(ebx & (1 << CPPC_CPUID_BIT))) {
+						error("This CPU does not support CPPC.");
+					}
+				}
+				cppc = 1;
+				if (c == OPT_CPPC) {
+					break;
+				}
+				cppcRequest[c - OPT_MAX_PERF] = parseNumber(optarg, 0, 255);
+				if (cppcRequest[c - OPT_MAX_PERF] == -1) {
+					fprintf(stderr, "ERROR: The CPPC %s value must be a number 0 to 255.\n", CPPC_REQ_NAMES[c - OPT_MAX_PERF]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case OPT_MONITOR: // Print the effective frequency and power.
+				monitorInterval = parseCount(optarg, INT_MAX / 1000, "Option --monitor must be a number of milliseconds from 1 to %d.");
+				break;
+			case OPT_NO_PERF: // Always read --monitor counters from the MSR devices.
+				usePerf = 0;
+				break;
+			case OPT_SMU_SIM: // File holding the SMN registers of a simulated SMU.
+				smuSim = optarg;
+				break;
+			case OPT_FORCE_SMN: // Use the SMN registers even though a driver also uses them.
+				forceSmn = 1;
+				break;
+			case OPT_STDIN: // Run the commands read from STDIN.
+				commandMode = 1;
+				break;
+			case OPT_STATS: // Print phase timings and MSR latencies at exit.
+				stats = 1;
+				break;
+			case OPT_CCX: // Core complex (shared L3) to work on.
+			case OPT_CCD: // Core die to work on.
+			case OPT_SOCKET: // CPU socket to work on.
+				if (unitType != UNIT_NONE) {
+					error("Only one of the options --ccx, --ccd and --socket can be used.");
+				}
+				unitType = (c == OPT_CCX ? UNIT_CCX : (c == OPT_CCD ? UNIT_CCD : UNIT_SOCKET));
+				if (strcmp(optarg, "all") != 0) {
+					if (!isdigit((unsigned char) optarg[0])) {
+						fprintf(stderr, "ERROR: Option --%s must be a number or 'all'.\n", UNIT_OPTS[unitType]);
+						exit(EXIT_FAILURE);
+					}
+					unitId = atoi(optarg);
+				}
+				break;
 			case '?': // Displays help.
 			case 'h':
 			default:
@@ -394,7 +969,404 @@ void parseOpts(const int argc, char **argv) {
 		error("You must pass the -p argument when passing the -x argument.");
 	}
 
-	uwmsrCheck(allowWrites);
+	if (summary && (nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1)) {
+		error("Option --summary can not be combined with options which change P-States.");
+	}
+	if (summary) {
+		fields &= ~FIELD_CORE;
+	}
+	if (pollInterval && (summary || nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1)) {
+		error("Option --poll can not be combined with --summary or options which change P-States.");
+	}
+	if (pollInterval && unitType != UNIT_NONE && unitId == -1) {
+		error("Option --poll needs a single CCX, CCD or socket.");
+	}
+	if (watchInterval) {
+		if (nbVid == -1 && cpuVid == -1 && cpuFid == -1 && cpuDid == -1 && togglePs == -1) {
+			error("Option --watch needs at least one of the options -a, -n, -v, -f or -d.");
+		}
+		if (summary || pollInterval) {
+			error("Option --watch can not be combined with --summary or --poll.");
+		}
+		watchedPstates = calloc(cores, 1);
+		if (watchedPstates == NULL) {
+			error("Could not allocate memory for --watch.");
+		}
+	}
+	if (commandMode && (unitType != UNIT_NONE || core > -1 || pstate > -1 || summary || pollInterval || watchInterval || transitionLatency ||
+		nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1 || boost > -1 || cc6 > -1 || pc6 > -1 || wakeLatency ||
+		currentOnly || customFields || cppc || cppcRequest[CPPC_MAX] > -1 || cppcRequest[CPPC_MIN] > -1 || cppcRequest[CPPC_DESIRED] > -1 ||
+		cppcRequest[CPPC_EPP] > -1 || powerLimits || newLimits[LIMIT_PPT] > -1 || newLimits[LIMIT_TDC] > -1 || newLimits[LIMIT_EDC] > -1 ||
+		benchSweeps || measurePerturb || monitorInterval || msrBudget)) {
+		error("Option --stdin takes the cores, P-States and values from its commands, it only combines with -t, -m, -i, --msr-dir and --stats.");
+	}
+	if (monitorInterval && (summary || pollInterval || watchInterval || transitionLatency || commandMode ||
+		nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1)) {
+		error("Option --monitor can not be combined with --summary, --poll, --watch, --transition-latency, --stdin or options which change P-States.");
+	}
+	if (monitorInterval && unitType != UNIT_NONE && unitId == -1) {
+		error("Option --monitor needs a single CCX, CCD or socket.");
+	}
+	if (measurePerturb && core == -1) {
+		error("Option --perturbation needs a CPU core, set with -c.");
+	}
+	if (transitionLatency && core == -1) {
+		error("Option --transition-latency needs a CPU core, set with -c.");
+	}
+	if (transitionLatency && (pollInterval || summary || nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1)) {
+		error("Option --transition-latency can not be combined with --poll, --summary or options which change P-States.");
+	}
+	if (unitType != UNIT_NONE) {
+		if (core > -1) {
+			fprintf(stderr, "ERROR: Option -c can not be combined with --%s.\n", UNIT_OPTS[unitType]);
+			exit(EXIT_FAILURE);
+		}
+		getTopology();
+		if (unitId >= unitCount) {
+			fprintf(stderr, "ERROR: %s must be less than the total number of %ss (0 to %d).\n", UNIT_NAMES[unitType], UNIT_NAMES[unitType], unitCount - 1);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	// North bridge voltages are only stored in the P-State registers on 10h and 11h.
+	if (cpuFamily != AMD10H && cpuFamily != AMD11H) {
+		fields &= ~(FIELD_NBVID | FIELD_NBVOLT);
+	}
+
+	if (stats) {
+		coreStats = calloc(cores, sizeof *coreStats);
+		if (coreStats == NULL) {
+			error("Could not allocate memory for --stats.");
+		}
+		atexit(printStats);
+		statsEnter(PHASE_PERMISSIONS);
+	}
+	// Monitoring through the perf PMUs needs neither root nor the msr module.
+	if (monitorInterval && usePerf) {
+		const int probe = perfEvent("msr", "aperf", 0, -1, NULL);
+		usePerf = (probe > -1);
+		if (probe > -1) {
+			close(probe);
+		}
+	}
+	if (!monitorInterval || !usePerf || boost > -1 || cc6 > -1 || pc6 > -1 || wakeLatency || cppc || powerLimits ||
+		newLimits[LIMIT_PPT] > -1 || newLimits[LIMIT_TDC] > -1 || newLimits[LIMIT_EDC] > -1) {
+		uwmsrCheck(allowWrites);
+	}
+	if (stats) {
+		statsEnter(PHASE_OUTPUT);
+	}
+}
+
+/**
+ * Parses a whole number that is not negative, the whole string has to be the number.
+ * @param arg -> The string.
+ * @param min -> The smallest value allowed.
+ * @param max -> The largest value allowed.
+ * @return long -> The number, or -1 when the string is not a number from min to max.
+ */
+long parseNumber(const char *arg, const long min, const long max) {
+	char *end;
+	long value;
+
+	// strtol() would also take leading spaces and a sign.
+	if (!isdigit((unsigned char) arg[0])) {
+		return -1;
+	}
+	errno = 0;
+	value = strtol(arg, &end, 10);
+	if (errno || *end || value < min || value > max) {
+		return -1;
+	}
+	return value;
+}
+
+/**
+ * Parses a positive whole number passed to an option.
+ * @param arg -> The option argument.
+ * @param max -> The largest value allowed.
+ * @param message -> Error shown when the argument is not a number from 1 to max, with %d for max.
+ * @return unsigned int -> The number.
+ */
+unsigned int parseCount(const char *arg, const int max, const char *message) {
+	const long value = parseNumber(arg, 1, max);
+
+	if (value == -1) {
+		if (!quiet) {
+			fprintf(stderr, "ERROR: ");
+			fprintf(stderr, message, max);
+			fprintf(stderr, "\n");
+		}
+		exit(EXIT_FAILURE);
+	}
+	return value;
+}
+
+/**
+ * Parses the comma separated list of columns passed to --fields.
+ * @param list -> The list of field names, modified in place.
+ */
+void parseFields(char *list) {
+	unsigned char i, found;
+	char *name;
+
+	fields = 0;
+	customFields = 1;
+	for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+		found = 0;
+		for (i = 0; i < sizeof FIELD_LIST / sizeof FIELD_LIST[0]; i++) {
+			if (strcmp(name, FIELD_LIST[i].name) == 0) {
+				fields |= FIELD_LIST[i].field;
+				found = 1;
+				break;
+			}
+		}
+		if (!found) {
+			fprintf(stderr, "ERROR: Unknown field '%s' passed to --fields, valid fields are:", name);
+			for (i = 0; i < sizeof FIELD_LIST / sizeof FIELD_LIST[0]; i++) {
+				fprintf(stderr, "%s%s", i ? "," : " ", FIELD_LIST[i].name);
+			}
+			fprintf(stderr, "\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!fields) {
+		error("Option --fields requires at least one field.");
+	}
+}
+
+/**
+ * Highest CPU fid (or CpuDidLSD on 14h) which can be set.
+ * @return int -> The limit.
+ */
+int fidLimit() {
+	switch (cpuFamily) {
+		case AMD14H:
+			return 3;
+		case AMD17H:
+		case AMD19H:
+			return 0xc0;
+		default:
+			return 0x2f;
+	}
+}
+
+/**
+ * Run the --stdin commands until the end of the input. Commands run against the state set up
+ * once at start, writes for the same core are held back and combined into a single write
+ * per register, which is done before the next core is touched or before waiting for input.
+ */
+void runCommands() {
+	const char *bits[] = {PSTATE_EN_BITS, NB_VID_BITS, CPU_VID_BITS, CPU_FID_BITS, CPU_DID_BITS};
+	command *queue = malloc(COMMAND_QUEUE * sizeof *queue), cmd;
+	unsigned int lines = 0, queued = 0, i;
+	short pendingCore = -1;
+	unsigned char f;
+	char *line;
+
+	if (queue == NULL) {
+		error("Could not allocate memory for --stdin.");
+	}
+	line = readCommandLine(1);
+	while (line != NULL) {
+		// Blank lines and # comments are not commands.
+		if (!line[strspn(line, " \t\r")] || line[strspn(line, " \t\r")] == '#') {
+			line = readCommandLine(1);
+			continue;
+		}
+		memset(&cmd, 0, sizeof cmd);
+		cmd.line = ++lines;
+		parseCommand(line, &cmd);
+		if (!cmd.error) {
+			if (cmd.core != pendingCore || queued == COMMAND_QUEUE) {
+				flushCommands(queue, &queued);
+				pendingCore = cmd.core;
+			}
+			// The last queued value of the register already holds the changes not written yet.
+			for (i = queued; i > 0 && (queue[i - 1].error || queue[i - 1].pstate != cmd.pstate); i--);
+			if (i) {
+				buffer = queue[i - 1].value;
+			} else {
+				core = cmd.core;
+				rwMsrReg(MSR_PSTATE_BASE + cmd.pstate, 1);
+			}
+			for (f = 0; f < sizeof COMMAND_OPTS - 1; f++) {
+				if (cmd.values[f] > -1) {
+					updateBuffer(bits[f], cmd.values[f]);
+				}
+			}
+			cmd.value = buffer;
+		} else if (queued == COMMAND_QUEUE) {
+			flushCommands(queue, &queued);
+		}
+		queue[queued++] = cmd;
+		line = readCommandLine(0);
+		if (line == NULL) {
+			flushCommands(queue, &queued);
+			pendingCore = -1;
+			line = readCommandLine(1);
+		}
+	}
+	flushCommands(queue, &queued);
+	free(queue);
+}
+
+/**
+ * Get the next --stdin line.
+ * @param wait -> 1 to wait for input, 0 to only return a line which is already waiting.
+ * @return char * -> The line, without its line break, NULL at the end of the input or when none is waiting.
+ */
+char *readCommandLine(const unsigned char wait) {
+	static char input[COMMAND_LINE + 1];
+	static size_t start = 0, length = 0;
+	static unsigned char ended = 0;
+	struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+	char *line, *end;
+	ssize_t got;
+
+	for (;;) {
+		end = memchr(input + start, '\n', length - start);
+		// A line longer than the buffer is cut, the remainder reads as the next command.
+		if (end != NULL || (length - start && (ended || (start == 0 && length == COMMAND_LINE)))) {
+			line = input + start;
+			if (end == NULL) {
+				end = input + length;
+			}
+			*end = 0;
+			start = end - input + (end < input + length);
+			return line;
+		}
+		if (ended || (!wait && poll(&pfd, 1, 0) < 1)) {
+			return NULL;
+		}
+		memmove(input, input + start, length - start);
+		length -= start;
+		start = 0;
+		got = read(STDIN_FILENO, input + length, COMMAND_LINE - length);
+		if (got <= 0) {
+			ended = 1;
+		} else {
+			length += got;
+		}
+	}
+}
+
+/**
+ * Parse a --stdin command, its options are written like on the command line.
+ * @param line -> The command, modified in place.
+ * @param cmd -> Receives the command, the error member is set if it is not valid.
+ */
+void parseCommand(char *line, command *cmd) {
+	char *token, *value, *opt;
+	int number;
+
+	cmd->core = -1;
+	cmd->pstate = -1;
+	memset(cmd->values, 0xff, sizeof cmd->values);
+	for (token = strtok(line, " \t\r"); token != NULL; token = strtok(NULL, " \t\r")) {
+		if (token[0] != '-' || !token[1] || (!strchr(COMMAND_OPTS, token[1]) && token[1] != 'c' && token[1] != 'p')) {
+			cmd->error = "unknown option, use -c, -p, -a, -n, -v, -f or -d";
+			return;
+		}
+		value = token[2] ? token + 2 : strtok(NULL, " \t\r");
+		// Only whole numbers, a typo must not turn into a smaller value that gets written.
+		if (value == NULL || (number = parseNumber(value, 0, INT_MAX)) == -1) {
+			cmd->error = "option without a whole number";
+			return;
+		}
+		switch (token[1]) {
+			case 'c':
+				if (number >= cores) {
+					cmd->error = "core out of range";
+					return;
+				}
+				cmd->core = number;
+				break;
+			case 'p':
+				if (number >= PSTATES) {
+					cmd->error = "P-State out of range";
+					return;
+				}
+				cmd->pstate = number;
+				break;
+			case 'a':
+				if (number > 1) {
+					cmd->error = "-a must be 1 or 0";
+					return;
+				}
+				break;
+			case 'n':
+				if (cpuFamily > AMD11H || number > MAX_VID) {
+					cmd->error = "NB vid out of range or not supported";
+					return;
+				}
+				break;
+			case 'v':
+				if (cpuFamily == AMD14H ? (number < COFVID_MAX_VID || number > COFVID_MIN_VID) : number > MAX_VID) {
+					cmd->error = "vid out of range";
+					return;
+				}
+				break;
+			case 'f':
+				if (number > fidLimit()) {
+					cmd->error = "fid out of range";
+					return;
+				}
+				break;
+			case 'd':
+				if (number > DIDS) {
+					cmd->error = "did out of range";
+					return;
+				}
+				break;
+		}
+		opt = strchr(COMMAND_OPTS, token[1]);
+		if (opt != NULL) {
+			cmd->values[opt - COMMAND_OPTS] = number;
+			cmd->write = 1;
+		}
+	}
+	if (cmd->core == -1 || cmd->pstate == -1) {
+		cmd->error = "a command needs -c and -p";
+	}
+}
+
+/**
+ * Do the held back --stdin writes and print the queued responses.
+ * Each changed register is written once, with the value of the last command changing it.
+ * @param queue -> The queued commands.
+ * @param queued -> Number of queued commands, set to 0.
+ */
+void flushCommands(command *queue, unsigned int *queued) {
+	unsigned int i, j;
+
+	for (i = 0; i < *queued; i++) {
+		if (queue[i].error || !queue[i].write) {
+			continue;
+		}
+		for (j = i + 1; j < *queued && (queue[j].error || !queue[j].write || queue[j].pstate != queue[i].pstate); j++);
+		if (j == *queued) {
+			core = queue[i].core;
+			buffer = queue[i].value;
+			rwMsrReg(MSR_PSTATE_BASE + queue[i].pstate, 0);
+		}
+	}
+	for (i = 0; i < *queued; i++) {
+		if (queue[i].error) {
+			printf("error %u %s\n", queue[i].line, queue[i].error);
+			continue;
+		}
+		buffer = queue[i].value;
+		printf(
+			"ok %u %s core=%d pstate=%d value=0x%016" PRIx64 " enabled=%d fid=%d did=%d vid=%d mhz=%.2f mv=%d%s\n",
+			queue[i].line, queue[i].write ? "set" : "get", queue[i].core, queue[i].pstate, buffer, getDec(PSTATE_EN_BITS),
+			getDec(CPU_FID_BITS), getDec(CPU_DID_BITS), getDec(CPU_VID_BITS),
+			getClockSpeed(getDec(CPU_FID_BITS), getDec(CPU_DID_BITS)), vidTomV(getDec(CPU_VID_BITS)),
+			queue[i].write && testMode ? " preview" : ""
+		);
+	}
+	fflush(stdout);
+	*queued = 0;
 }
 
 /**
@@ -426,7 +1398,8 @@ void usage() {
 		printf("    -f    Set the CPU frequency id (fid).\n");
 	}
 	printf("    -a    Activate (1) or deactivate (0) P-state.\n");
-	printf("    -e    Show current P-State only. (Not available on 17h / 19h)\n");
+	printf("    -b    Enable (1) or disable (0) Core Performance Boost (turbo).\n");
+	printf("    -e    Show current P-State only.\n");
 	printf("    -t    Preview changes without applying them to the CPU / north bridge.\n");
 	printf("    -u    Try to find voltage id by voltage (millivolts).\n");
 	printf("    -m    On Linux kernel >= 5.9, enables userspace MSR writing.\n");
@@ -434,14 +1407,107 @@ void usage() {
 	printf("    -i    Show debug info.\n");
 	printf("    -h    Shows this information.\n");
 	printf("    -x    Explains field name descriptions.\n");
+	printf("    --fields=LIST\n");
+	printf("          Only read and print the comma separated columns in LIST, one table for all cores.\n");
+	printf("          Fields: core,pstate,status,fid,did,vid,mult,mhz,mv,iddval,idddiv,amps,watts,nbvid,nbmv\n");
+	if (cpuFamily == AMD17H || cpuFamily == AMD19H) {
+		printf("    --cc6=N\n");
+		printf("          Enable (1) or disable (0) the core C6 state.\n");
+		printf("    --pc6=N\n");
+		printf("          Enable (1) or disable (0) the package C6 state.\n");
+	}
+	printf("    --wake-latency\n");
+	printf("          Measure the wake-up latency of the selected cores (before and after --cc6 / --pc6 changes).\n");
+	printf("    --ccx=N|all, --ccd=N|all, --socket=N|all\n");
+	printf("          Work on the cores of a core complex (shared L3), core die or socket, 'all' goes through each in turn.\n");
+	printf("    --poll=MS\n");
+	printf("          Print the current P-State of the selected cores every MS milliseconds, only reading the status register.\n");
+	printf("    --samples=N\n");
+	printf("          Stop --poll or --monitor after N samples, or measure each --transition-latency pair N times (default %d).\n", TRANSITION_SAMPLES);
+	printf("    --monitor=MS\n");
+	printf("          Print the effective frequency and C0 residency of the selected cores and their package power every MS milliseconds.\n");
+	printf("          Uses the kernel msr / power perf PMUs when available, else the MSR devices. The PMUs do not need root,\n");
+	printf("          only CAP_PERFMON or kernel.perf_event_paranoid <= 0.\n");
+	printf("    --no-perf\n");
+	printf("          Read the --monitor counters from the MSR devices instead of the perf PMUs.\n");
+	printf("    --transition-latency\n");
+	printf("          Measure how long the core set with -c takes to switch between each pair of enabled P-States.\n");
+	printf("    --no-io-uring\n");
+	printf("          Read the registers of a sweep with one pread per register instead of one io_uring batch.\n");
+	printf("    --msr-dir=DIR\n");
+	printf("          Use DIR/N/msr instead of /dev/cpu/N/msr, for example a simulated device tree.\n");
+	printf("    --bench=N\n");
+	printf("          Time N full register sweeps of the selected cores with pread and with io_uring.\n");
+	printf("    --perturbation\n");
+	printf("          Estimate the latency MSR reads add to a program running on the core set with -c.\n");
+	printf("    --budget=N\n");
+	printf("          Read each core's MSRs at most N times per second, later reads reuse the last value read\n");
+	printf("          from the register or wait if there is none.\n");
+	printf("    --watch=S\n");
+	printf("          Keep running after setting P-States, every S seconds and after resume re-apply them if they changed.\n");
+	if (cpuFamily == AMD17H || cpuFamily == AMD19H) {
+		printf("    --power-limits\n");
+		printf("          Show the package power (PPT) and current (TDC, EDC) limits of the SMU and the values against them.\n");
+		printf("    --ppt=W, --tdc=A, --edc=A\n");
+		printf("          Set the package power limit in watts, sustained or peak current limit in amps (until reboot).\n");
+		printf("    --cppc\n");
+		printf("          Show the CPPC performance capabilities (and their MHz) and request of the selected cores.\n");
+		printf("    --max-perf=N, --min-perf=N, --desired-perf=N, --epp=N\n");
+		printf("          Set the CPPC request fields (0 to 255) of the selected cores, --desired-perf=0 lets the CPU choose.\n");
+		printf("    --pci-dir=DIR, --mem-dev=PATH\n");
+		printf("          Use DIR/00 and PATH instead of /proc/bus/pci/00 and /dev/mem. Copied files serve the PCI register\n");
+		printf("          reads, the SMU mailbox needs DIR/00/00.0 to emulate the SMN index / data registers.\n");
+		printf("    --smu-sim=FILE\n");
+		printf("          Talk to a simulated SMU instead, its SMN registers are kept in FILE (at their address) and\n");
+		printf("          the limits it is sent are written to its power table in the --mem-dev file.\n");
+		printf("    --force-smn\n");
+		printf("          Use the SMU mailbox while k10temp, amd_pmc or amd64_edac is loaded (they race with amdctl).\n");
+	}
+	printf("    --stdin\n");
+	printf("          Run commands read from STDIN, one per line, written with the options -c, -p, -a, -n, -v, -f and -d.\n");
+	printf("          A command without -a, -n, -v, -f or -d reads the P-State. One line is printed per command:\n");
+	printf("          'ok N get|set core=C pstate=P value=0xR ...' or 'error N message', N counts the commands from 1.\n");
+	printf("          Writes to the core of the previous command are combined until a command for another core or\n");
+	printf("          until no further command is waiting, the responses follow once they are written.\n");
+	printf("    --stats\n");
+	printf("          At exit print the time spent in each phase and per-core MSR latency histograms to STDERR.\n");
+	printf("          Batched reads go through pread instead of io_uring, so each of them is timed.\n");
+	printf("    --summary\n");
+	printf("          Group cores with identical P-State registers, print each distinct table once.\n");
 	printf("Notes:\n");
 	printf("    1 volt = 1000 millivolts.\n");
 	printf("    All P-States are assumed if -p is not set.\n");
-	printf("    All CPU cores assumed if -c is not set.\n");
+	printf("    All CPU cores assumed if -c, --ccx, --ccd or --socket is not set.\n");
 	printf("Examples:\n");
 	printf("    amdctl                      Shows this infortmation.\n");
 	printf("    amdctl -g -c0               Displays all P-State info for CPU core 0.\n");
 	printf("    amdctl -g -c3 -p1           Displays P-State 1 info for CPU core 3.\n");
+	printf("    amdctl -b0 -c2              Disables boost on CPU core 2.\n");
+	if (cpuFamily == AMD17H || cpuFamily == AMD19H) {
+		printf("    amdctl --cc6=0 --wake-latency -c4\n");
+		printf("                                Disables CC6 on CPU core 4, shows the wake-up latency before and after.\n");
+	}
+	printf("    amdctl -g --ccd=1 -p0       Displays P-State 0 info for the cores of CCD 1.\n");
+	printf("    amdctl --poll=100 --samples=10 -c0\n");
+	printf("                                Displays the current P-State of CPU core 0 every 100 milliseconds, 10 times.\n");
+	printf("    amdctl --transition-latency -c1\n");
+	printf("                                Displays min / median / p99 P-State switching time of CPU core 1.\n");
+	printf("    amdctl --monitor=1000 --ccd=0\n");
+	printf("                                Displays the effective frequency of the CCD 0 cores and the package power every second.\n");
+	printf("    amdctl --poll=10 --budget=20\n");
+	printf("                                Displays the current P-State every 10ms, reading each core at most 20 times per second.\n");
+	printf("    amdctl -p1 -v40 --watch=60  Sets CpuVid 40 on P-State 1, restores it when firmware resets it.\n");
+	if (cpuFamily == AMD17H || cpuFamily == AMD19H) {
+		printf("    amdctl --ppt=88 --power-limits\n");
+		printf("                                Caps the package power to 88 watts, shows the limits and current values.\n");
+		printf("    amdctl --epp=0 --min-perf=120 --ccd=0\n");
+		printf("                                Asks the CCD 0 cores for performance over energy saving, never below nominal.\n");
+	}
+	printf("    printf -- '-c12 -p0\\n-c40 -p2 -v40\\n' | amdctl --stdin\n");
+	printf("                                Reads P-State 0 of CPU core 12, sets CpuVid 40 on P-State 2 of CPU core 40.\n");
+	printf("    amdctl -g --summary         Displays each distinct P-State table once, with the cores using it.\n");
+	printf("    amdctl -p0 --fields=core,vid,mhz\n");
+	printf("                                Displays the P-State 0 CpuVid and CpuFreq of every core.\n");
 	exit(EXIT_SUCCESS);
 }
 
@@ -451,6 +1517,7 @@ void usage() {
 void fieldDescriptions() {
 	printf("Core:        Cpu core.\n");
 	printf("P-State:     Power state, lower number means higher performance, 'current' means the P-State the CPU is in currently.\n");
+	printf("               On 17h, 19h (Zen) 'current' is read from the hardware P-State status register.\n");
 	printf("Status:      If the P-State is enabled (1) or disabled (0).\n");
 	printf("CpuFid:      Core frequency ID, with the CpuDid, this is used to calculate the core clock speed.\n");
 	printf("CpuDid:      Core divisor ID, see CpuFid.\n");
@@ -467,6 +1534,20 @@ void fieldDescriptions() {
 	printf("               On 17h, 19h (Zen) the current draw is calculated as : IddVal + IddDiv\n");
 	printf("CpuPower:    The cpu power draw, in watts.\n");
 	printf("               Power draw is calculated as : (CpuCurr * CpuVolt) / 1000\n");
+	printf("Boost:       If Core Performance Boost (turbo) can raise the core above P-State 0 (HWCR CpbDis bit).\n");
+	printf("EffFreq:     Average clock speed while the core was active, measured with APERF / MPERF, in megahertz.\n");
+	printf("C0:          Share of the time the core was active (not sleeping), MPERF / TSC.\n");
+	printf("Package:     Power drawn by the CPU package (socket) from its RAPL energy counter, in watts, 17h / 19h only.\n");
+	printf("CC6:         If the core can enter the C6 (deepest) idle state, 17h / 19h only.\n");
+	printf("PC6:         If the package can enter the C6 idle state once all cores are in CC6, 17h / 19h only.\n");
+	printf("CPPC:        Collaborative processor performance control, the OS requests an abstract performance level (0-255)\n");
+	printf("               between Min and Max, or Desired (0 = CPU chooses, biased by EPP, 0 performance to 255 energy saving).\n");
+	printf("               Highest is the boost limit, Nominal the base clock, Lowest nonlinear the most efficient level.\n");
+	printf("               MHz are scaled from Nominal and the P-State 0 frequency.\n");
+	printf("PPT:         Package power tracking, the socket power limit enforced by the SMU, in watts.\n");
+	printf("TDC:         Thermal design current, the sustained current limit of the core voltage regulator, in amps.\n");
+	printf("EDC:         Electrical design current, the peak current limit of the core voltage regulator, in amps.\n");
+	printf("Wake-up:     Time a sleeping core takes to resume past its timer deadline, in microseconds.\n");
 	printf("REFCLK:      Used for doing some calculations, this is a fixed value, not based on the value you set in the BIOS/UEFI.\n");
 	exit(EXIT_SUCCESS);
 }
@@ -518,143 +1599,1578 @@ void uwmsrCheck(const unsigned char allowWrites) {
 }
 
 /**
- * Iterate CPU cores, get/set PState values.
+ * Finds the CCX, CCD or socket of every CPU core from the sysfs topology, numbering the
+ * units in order of their lowest core. A CCX is the set of cores sharing an L3 cache.
+ * On 17h / 19h a CCD is found from the APIC ID, die_id is the node there and 17h models
+ * from 30h on have one node per package. Other families use die_id within a package.
  */
-void wrCpuStates() {
-	uint32_t tmp_pstates[PSTATES];
-	unsigned char pstates_count = 0;
-	if (pstate == -1) {
-		for (; pstates_count < PSTATES; pstates_count++) {
-			tmp_pstates[pstates_count] = (MSR_PSTATE_BASE + pstates_count);
-		}
-	} else { // User only requested 1 PState.
-		tmp_pstates[0] = MSR_PSTATE_BASE + pstate;
-		pstates_count = 1;
-	}
+void getTopology() {
+	const signed char shift = (unitType == UNIT_CCD ? ccdApicShift() : -1);
+	int *apicIds = (shift > -1 ? readApicIds() : NULL);
+	char path[96];
+	unsigned short cpu, i, packages = 0;
+	int *keys = malloc(cores * sizeof *keys), *packageKeys = malloc(cores * sizeof *packageKeys), key, level, package;
+	unsigned char index;
 
-	for (; core < cores; core++) {
-		rwMsrReg(MSR_PSTATE_CURRENT_LIMIT, 1);
-		int i, curPstate = getDec(CUR_PSTATE_BITS), minPstate = getDec(PSTATE_MAX_VAL_BITS), maxPstate = getDec(CUR_PSTATE_LIMIT_BITS);
-		switch (cpuFamily) {
-			case AMD17H:
-			case AMD19H:
+	unitOf = malloc(cores * sizeof *unitOf);
+	selectedCores = malloc(cores);
+	if (keys == NULL || packageKeys == NULL || unitOf == NULL || selectedCores == NULL) {
+		error("Could not allocate memory for the CPU topology.");
+	}
+	for (cpu = 0; cpu < cores; cpu++) {
+		key = -1;
+		switch (unitType) {
+			case UNIT_CCX:
+				for (index = 0; index < 8; index++) {
+					sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, index);
+					if ((level = readSysfsInt(path)) == -1) {
+						break;
+					}
+					if (level == 3) {
+						// First core in the list is the CCX key.
+						sprintf(path, "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, index);
+						key = readSysfsInt(path);
+						break;
+					}
+				}
 				break;
-			default:
-				curPstate++;
-				minPstate++;
-				maxPstate++;
+			case UNIT_CCD:
+				// APIC IDs are unique across packages, their bits above the CCD shift number the CCD.
+				if (apicIds != NULL && apicIds[cpu] > -1) {
+					key = apicIds[cpu] >> shift;
+					break;
+				}
+				sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/die_id", cpu);
+				key = readSysfsInt(path);
+				sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+				package = readSysfsInt(path);
+				key = (key == -1 || package == -1) ? -1 : (package << 16) | key;
+				for (i = 0; i < packages && packageKeys[i] != package; i++);
+				if (i == packages) {
+					packageKeys[packages++] = package;
+				}
+				break;
+			case UNIT_SOCKET:
+				sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+				key = readSysfsInt(path);
 				break;
 		}
-		rwMsrReg(MSR_PSTATE_STATUS, 1);
-		if (!quiet) {
-			printf("\nCore %d | P-State Limits (non-turbo): Highest: %d ; Lowest %d | Current P-State: %d\n", core, maxPstate, minPstate, curPstate);
-			printf(" Pstate Status CpuFid CpuDid CpuVid  CpuMult     CpuFreq CpuVolt IddVal IddDiv CpuCurr CpuPower");
-			printf("%s\n", (cpuFamily == AMD10H || cpuFamily == AMD11H) ? " NbVid NbVolt" : "");
+		if (key == -1) {
+			fprintf(stderr, "ERROR: Could not find the %s of CPU core %d in /sys/devices/system/cpu.\n", UNIT_NAMES[unitType], cpu);
+			exit(EXIT_FAILURE);
 		}
-		if (!currentOnly) {
-			for (i = 0; i < pstates_count; i++) {
-				if (!quiet) {
-					printf("%7d", (pstate >= 0 ? pstate : i));
-				}
-				rwMsrReg(tmp_pstates[i], 1);
-				if (nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1) {
-					if (togglePs > -1) {
-						updateBuffer(PSTATE_EN_BITS, togglePs);
-					}
-					if (nbVid > -1) {
-						updateBuffer(NB_VID_BITS, nbVid);
-					}
-					if (cpuVid > -1) {
-						updateBuffer(CPU_VID_BITS, cpuVid);
-					}
-					if (cpuFid > -1) {
-						updateBuffer(CPU_FID_BITS, cpuFid);
-					}
-					if (cpuDid > -1) {
-						updateBuffer(CPU_DID_BITS, cpuDid);
-					}
+		for (i = 0; i < unitCount && keys[i] != key; i++);
+		if (i == unitCount) {
+			keys[unitCount++] = key;
+		}
+		unitOf[cpu] = i;
+	}
+	if (packages && unitCount == packages && !quiet) {
+		printf("WARNING: The kernel reports one die per package, --ccd selects whole sockets.\n");
+	}
+	free(keys);
+	free(packageKeys);
+	free(apicIds);
+}
+
+/**
+ * Reads the APIC ID of every CPU core from /proc/cpuinfo.
+ * @return int * -> cores APIC IDs, -1 for a core without one. Freed by the caller.
+ */
+int *readApicIds() {
+	int *apicIds = malloc(cores * sizeof *apicIds), cpu = -1, id;
+	char buff[128];
+	FILE *fp;
+
+	if (apicIds == NULL) {
+		error("Could not allocate memory for the APIC IDs.");
+	}
+	memset(apicIds, 0xff, cores * sizeof *apicIds);
+	fp = fopen("/proc/cpuinfo", "r");
+	if (fp == NULL) {
+		error("Could not open /proc/cpuinfo for reading.");
+	}
+	while (fgets(buff, sizeof buff, fp)) {
+		if (!strncmp(buff, "processor", 9)) {
+			sscanf(buff, "%*s : %d", &cpu);
+		} else if (!strncmp(buff, "apicid", 6) && sscanf(buff, "%*s : %d", &id) == 1 && cpu > -1 && cpu < cores) {
+			apicIds[cpu] = id;
+		}
+	}
+	fclose(fp);
+	return apicIds;
+}
+
+/**
+ * Finds how far the APIC ID is shifted to get the CCD, on 17h / 19h.
+ * The L3 of a CCX spans the lowest APIC ID bits (CPUID 8000_001D, as the kernel finds its
+ * LLC ID), 17h has two CCXs per die (CCD or Zeppelin die), 19h one.
+ * @return signed char -> The shift, -1 if the CPU does not report it.
+ */
+signed char ccdApicShift() {
+	unsigned int eax, ebx, ecx, edx, subleaf, sharing;
+	signed char shift = 0;
+
+	if (cpuFamily != AMD17H && cpuFamily != AMD19H) {
+		return -1;
+	}
+	if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x8000001d) {
+		return -1;
+	}
+	for (subleaf = 0; ; subleaf++) {
+		__cpuid_count(0x8000001d, subleaf, eax, ebx, ecx, edx);
+		// Cache type 0 ends the list, level is in bits 7:5.
+		if (!(eax & 0x1f)) {
+			return -1;
+		}
+		if (((eax >> 5) & 7) == 3) {
+			break;
+		}
+	}
+	sharing = ((eax >> 14) & 0xfff) + 1;
+	while ((1U << shift) < sharing) {
+		shift++;
+	}
+	return shift + (cpuFamily == AMD17H);
+}
+
+/**
+ * Identifies the physical core a CPU core (hardware thread) belongs to, SMT siblings share it.
+ * @param cpu -> The CPU core.
+ * @return int -> Package ID in the high, core ID in the low 16 bits, or -1 if unknown.
+ */
+int physicalCore(const short cpu) {
+	char path[96];
+	int package, id;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+	package = readSysfsInt(path);
+	sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+	id = readSysfsInt(path);
+	return (package == -1 || id == -1) ? -1 : (package << 16) | id;
+}
+
+/**
+ * Reads the first number from a sysfs file.
+ * @param path -> The file to read.
+ * @return int -> The number or -1 on failure.
+ */
+int readSysfsInt(const char *path) {
+	FILE *fp;
+	int value = -1;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fscanf(fp, "%d", &value) != 1) {
+		value = -1;
+	}
+	fclose(fp);
+	return value;
+}
+
+/**
+ * Selects the cores of a CCX / CCD / socket, sets core to the first one.
+ * @param unit -> The unit number.
+ */
+void selectUnit(const unsigned short unit) {
+	unsigned short cpu;
+	for (cpu = 0; cpu < cores; cpu++) {
+		selectedCores[cpu] = (unitOf[cpu] == unit);
+	}
+	core = nextCore(0);
+}
+
+/**
+ * @param from -> Core to start looking from.
+ * @return short -> The first selected core >= from, cores if there are none left.
+ */
+short nextCore(const short from) {
+	short cpu = from;
+	while (selectedCores != NULL && cpu < cores && !selectedCores[cpu]) {
+		cpu++;
+	}
+	return cpu;
+}
+
+/**
+ * @return unsigned short -> The number of selected cores from the core variable on.
+ */
+unsigned short selectedCount() {
+	unsigned short count = 0;
+	short cpu;
+	for (cpu = core; cpu < cores; cpu = nextCore(cpu + 1)) {
+		count++;
+	}
+	return count;
+}
+
+/**
+ * Print the selected cores as a compact range list, for example 0-3,32-35.
+ */
+void printCoreList() {
+	short cpu, last;
+	unsigned char first = 1;
+	for (cpu = core; cpu < cores; cpu = nextCore(last + 1)) {
+		for (last = cpu; last + 1 < cores && nextCore(last + 1) == last + 1; last++);
+		if (last == cpu) {
+			printf("%s%d", first ? "" : ",", cpu);
+		} else {
+			printf("%s%d-%d", first ? "" : ",", cpu, last);
+		}
+		first = 0;
+	}
+}
+
+/**
+ * Enable or disable Core Performance Boost on the selected cores through the HWCR CpbDis bit.
+ * Prints the old and new boost state of each core and, unless in preview mode, the
+ * effective frequency measured before and after the change.
+ */
+void setBoost() {
+	const unsigned short firstCore = core, count = cores - core;
+	unsigned char *wasOff = malloc(count);
+	float *before = malloc(count * sizeof *before), *after = malloc(count * sizeof *after);
+	unsigned short i;
+
+	if (wasOff == NULL || before == NULL || after == NULL) {
+		error("Could not allocate memory for the boost change.");
+	}
+	if (!quiet) {
+		sampleEffectiveFreqs(before);
+	}
+	for (core = firstCore; core < cores; core = nextCore(core + 1)) {
+		rwMsrReg(MSR_HWCR, 1);
+		wasOff[core - firstCore] = getDec(CPB_DIS_BITS);
+		if (wasOff[core - firstCore] != !boost) {
+			updateBuffer(CPB_DIS_BITS, !boost);
+			rwMsrReg(MSR_HWCR, 0);
+		}
+	}
+	if (!quiet) {
+		if (!testMode) {
+			sampleEffectiveFreqs(after);
+		}
+		for (i = firstCore; i < cores; i = nextCore(i + 1)) {
+			const unsigned short n = i - firstCore;
+			printf("Core %d | Boost: %s -> %s | Effective frequency: %.2fMHz", i, wasOff[n] ? "Off" : "On", boost ? "On" : "Off", before[n]);
+			if (testMode) {
+				printf(" (preview, not changed)\n");
+			} else {
+				printf(" -> %.2fMHz\n", after[n]);
+			}
+		}
+	}
+	core = firstCore;
+	free(wasOff);
+	free(before);
+	free(after);
+}
+
+/**
+ * Measure the effective frequency of the selected cores over a short interval,
+ * the first non-boost P-State frequency (MPERF rate) scaled by the APERF / MPERF ratio.
+ * @param freqs -> Receives the frequency in MHz of each selected core, indexed from the first selected core.
+ */
+void sampleEffectiveFreqs(float *freqs) {
+	const unsigned short firstCore = core, count = cores - core;
+	uint64_t *counters = malloc(count * 2 * sizeof *counters);
+	unsigned short i;
+
+	if (counters == NULL) {
+		error("Could not allocate memory for the APERF / MPERF samples.");
+	}
+	for (core = firstCore; core < cores; core = nextCore(core + 1)) {
+		i = core - firstCore;
+		rwMsrReg(MSR_APERF, 1);
+		counters[i * 2] = buffer;
+		rwMsrReg(MSR_MPERF, 1);
+		counters[i * 2 + 1] = buffer;
+	}
+	usleep(100000);
+	for (core = firstCore; core < cores; core = nextCore(core + 1)) {
+		i = core - firstCore;
+		rwMsrReg(MSR_APERF, 1);
+		const uint64_t aperf = buffer - counters[i * 2];
+		rwMsrReg(MSR_MPERF, 1);
+		const uint64_t mperf = buffer - counters[i * 2 + 1];
+		rwMsrReg(MSR_PSTATE_BASE + boostStates(), 1);
+		freqs[i] = mperf ? getClockSpeed(getDec(CPU_FID_BITS), getDec(CPU_DID_BITS)) * ((float) aperf / (float) mperf) : 0.0;
+	}
+	core = firstCore;
+	free(counters);
+}
+
+/**
+ * Number of boost P-States, which on 15h and 16h come before the software P-State 0
+ * in the P-State registers. Read once from the CPB control register.
+ * @return unsigned char -> The number of boost P-States, 0 on other families.
+ */
+unsigned char boostStates() {
+	static signed char count = -1;
+
+	if (count == -1) {
+		count = 0;
+		if (cpuFamily == AMD15H || cpuFamily == AMD16H) {
+			const uint64_t saved = buffer;
+			rwPciReg(ADDR_CPB_CONTROL, REG_CPB_CONTROL, 1);
+			count = getDec(NUM_BOOST_STATES_BITS);
+			buffer = saved;
+		}
+	}
+	return count;
+}
+
+/**
+ * Enable or disable CC6 / PC6 on the selected cores and optionally measure
+ * the wake-up latency before and after the change.
+ */
+void setCStates() {
+	const unsigned short firstCore = core;
+	unsigned char i;
+
+	if (wakeLatency) {
+		measureWakeLatency((cc6 > -1 || pc6 > -1) ? "before" : NULL);
+	}
+	if (cc6 == -1 && pc6 == -1) {
+		return;
+	}
+	for (; core < cores; core = nextCore(core + 1)) {
+		if (cc6 > -1) {
+			const unsigned char wasOn = getCc6();
+			for (i = 0; i < sizeof CC6_EN_BITS / sizeof CC6_EN_BITS[0]; i++) {
+				updateBuffer(CC6_EN_BITS[i], cc6);
+			}
+			rwMsrReg(MSR_CSTATE_CONFIG, 0);
+			if (!quiet) {
+				printf("Core %d | CC6: %s -> %s%s\n", core, wasOn ? "On" : "Off", cc6 ? "On" : "Off", testMode ? " (preview, not changed)" : "");
+			}
+		}
+		if (pc6 > -1) {
+			rwMsrReg(MSR_PMGT_MISC, 1);
+			const unsigned char wasOn = getDec(PC6_EN_BITS);
+			updateBuffer(PC6_EN_BITS, pc6);
+			rwMsrReg(MSR_PMGT_MISC, 0);
+			if (!quiet) {
+				printf("Core %d | PC6: %s -> %s%s\n", core, wasOn ? "On" : "Off", pc6 ? "On" : "Off", testMode ? " (preview, not changed)" : "");
+			}
+		}
+	}
+	core = firstCore;
+	if (wakeLatency && !testMode) {
+		measureWakeLatency("after");
+	}
+}
+
+/**
+ * Print the CPPC capabilities and request of the selected cores, setting the request
+ * fields passed with --max-perf, --min-perf, --desired-perf and --epp.
+ */
+void setCppc() {
+	const unsigned short firstCore = core;
+	unsigned char i, changed, old[CPPC_FIELDS];
+	float mhzPerPerf;
+
+	for (; core < cores; core = nextCore(core + 1)) {
+		rwMsrReg(MSR_CPPC_ENABLE, 1);
+		if (!getDec(CPPC_EN_BITS)) {
+			if (cppcRequest[CPPC_MAX] > -1 || cppcRequest[CPPC_MIN] > -1 || cppcRequest[CPPC_DESIRED] > -1 || cppcRequest[CPPC_EPP] > -1) {
+				fprintf(stderr, "ERROR: CPPC is not enabled on core %d (the amd-pstate driver enables it).\n", core);
+				exit(EXIT_FAILURE);
+			}
+			if (!quiet) {
+				printf("Core %d | CPPC: Off\n", core);
+			}
+			continue;
+		}
+		// The performance levels are linear in frequency, nominal performance runs at the P-State 0 clock.
+		rwMsrReg(MSR_PSTATE_BASE, 1);
+		mhzPerPerf = getClockSpeed(getDec(CPU_FID_BITS), getDec(CPU_DID_BITS));
+		rwMsrReg(MSR_CPPC_CAP1, 1);
+		mhzPerPerf = getDec(CPPC_NOMINAL_BITS) ? mhzPerPerf / getDec(CPPC_NOMINAL_BITS) : 0;
+		if (!quiet) {
+			printf(
+				"Core %d | CPPC: On | Highest: %d (%.0fMHz) ; Nominal: %d (%.0fMHz) ; Lowest nonlinear: %d (%.0fMHz) ; Lowest: %d (%.0fMHz)\n",
+				core,
+				getDec(CPPC_HIGHEST_BITS), getDec(CPPC_HIGHEST_BITS) * mhzPerPerf,
+				getDec(CPPC_NOMINAL_BITS), getDec(CPPC_NOMINAL_BITS) * mhzPerPerf,
+				getDec(CPPC_NONLINEAR_BITS), getDec(CPPC_NONLINEAR_BITS) * mhzPerPerf,
+				getDec(CPPC_LOWEST_BITS), getDec(CPPC_LOWEST_BITS) * mhzPerPerf
+			);
+		}
+		rwMsrReg(MSR_CPPC_REQ, 1);
+		changed = 0;
+		for (i = 0; i < CPPC_FIELDS; i++) {
+			old[i] = getDec(CPPC_REQ_BITS[i]);
+			if (cppcRequest[i] > -1 && cppcRequest[i] != old[i]) {
+				updateBuffer(CPPC_REQ_BITS[i], cppcRequest[i]);
+				changed = 1;
+			}
+		}
+		if (changed) {
+			rwMsrReg(MSR_CPPC_REQ, 0);
+		}
+		if (changed && !testMode) {
+			// Read back past the batch and --budget, they would return the request from before the write.
+			const uint64_t intended = buffer;
+			if (pread(msrFd(core, 1), &buffer, sizeof buffer, MSR_CPPC_REQ) != sizeof buffer) {
+				fprintf(stderr, "ERROR: Could not read data from %s/%d/msr\n", msrDir, core);
+				exit(EXIT_FAILURE);
+			}
+			if (buffer != intended) {
+				fprintf(stderr, "ERROR: The CPPC request of core %d reads back 0x%016" PRIx64 " instead of 0x%016" PRIx64 ".\n", core, buffer, intended);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if (quiet) {
+			continue;
+		}
+		printf("Core %d | CPPC request:", core);
+		for (i = 0; i < CPPC_FIELDS; i++) {
+			printf("%s %s: %d", i ? " ;" : "", CPPC_REQ_NAMES[i], old[i]);
+			if (cppcRequest[i] > -1) {
+				printf(" -> %d", cppcRequest[i]);
+			}
+			if (i < CPPC_EPP && getDec(CPPC_REQ_BITS[i])) {
+				printf(" (%.0fMHz)", getDec(CPPC_REQ_BITS[i]) * mhzPerPerf);
+			}
+		}
+		printf("%s\n", changed && testMode ? " (preview, not changed)" : "");
+	}
+	core = firstCore;
+}
+
+/**
+ * Reads the C-state config register of the current core into the buffer.
+ * @return unsigned char -> 1 if CC6 is enabled in every C-state action field.
+ */
+unsigned char getCc6() {
+	unsigned char i, enabled = 1;
+	rwMsrReg(MSR_CSTATE_CONFIG, 1);
+	for (i = 0; i < sizeof CC6_EN_BITS / sizeof CC6_EN_BITS[0]; i++) {
+		enabled &= getDec(CC6_EN_BITS[i]);
+	}
+	return enabled;
+}
+
+/**
+ * Measure how late a thread pinned to each selected core wakes up from a timed sleep,
+ * which is dominated by the exit latency of the idle state the core was in.
+ * The timer slack is lowered to 1ns meanwhile, the default 50us would hide the exit latency.
+ * @param when -> Label printed with the results (before / after), or NULL.
+ */
+void measureWakeLatency(const char *when) {
+	cpu_set_t oldSet, set;
+	uint64_t samples[WAKE_SAMPLES], stats[3];
+	struct timespec deadline;
+	unsigned short cpu;
+	unsigned int i;
+	int slack, err;
+
+	if (quiet) {
+		return;
+	}
+	if (sched_getaffinity(0, sizeof oldSet, &oldSet) != 0) {
+		error("Could not get the CPU affinity of amdctl.");
+	}
+	slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+	if (slack < 0 || prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0) != 0) {
+		error("Could not lower the timer slack of amdctl.");
+	}
+	for (cpu = core; cpu < cores; cpu = nextCore(cpu + 1)) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof set, &set) != 0) {
+			fprintf(stderr, "ERROR: Could not move amdctl to CPU core %d.\n", cpu);
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < WAKE_SAMPLES; i++) {
+			const uint64_t target = monotonicNs() + WAKE_SLEEP_NS;
+			deadline.tv_sec = target / 1000000000ULL;
+			deadline.tv_nsec = target % 1000000000ULL;
+			while ((err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR);
+			if (err) {
+				error("Could not sleep for the wake-up latency measurement.");
+			}
+			samples[i] = monotonicNs() - target;
+		}
+		latencyStats(samples, WAKE_SAMPLES, stats);
+		printf(
+			"Core %d | Wake-up latency%s%s: min %.1fus ; median %.1fus ; p99 %.1fus\n",
+			cpu, when ? " " : "", when ? when : "", stats[0] / 1000.0, stats[1] / 1000.0, stats[2] / 1000.0
+		);
+	}
+	sched_setaffinity(0, sizeof oldSet, &oldSet);
+	prctl(PR_SET_TIMERSLACK, slack, 0, 0, 0);
+}
+
+/**
+ * Comparison function for qsort, sorts uint64_t in ascending order.
+ */
+static int compareU64(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Sorts latency samples and gets the min, median and 99th percentile.
+ * @param samples -> The samples, sorted in place.
+ * @param count -> Number of samples.
+ * @param stats -> Receives min, median and p99.
+ */
+void latencyStats(uint64_t *samples, const unsigned int count, uint64_t *stats) {
+	qsort(samples, count, sizeof *samples, compareU64);
+	stats[0] = samples[0];
+	stats[1] = samples[count / 2];
+	stats[2] = samples[(count * 99) / 100 < count ? (count * 99) / 100 : count - 1];
+}
+
+/**
+ * @return uint64_t -> The monotonic clock, in nanoseconds.
+ */
+uint64_t monotonicNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Switch --stats to another phase, the time since the last switch goes to the current one.
+ * @param phase -> The new phase.
+ * @return unsigned char -> The phase which was current, to return to with statsLeave().
+ */
+unsigned char statsEnter(const unsigned char phase) {
+	const uint64_t now = monotonicNs();
+	const unsigned char previous = statsPhase;
+	phaseNs[statsPhase] += now - statsMark;
+	statsMark = now;
+	statsPhase = phase;
+	return previous;
+}
+
+/**
+ * End a register access timed since statsEnter(), counting it in the histogram of its core.
+ * @param previous -> The phase to return to.
+ * @param cpu -> The core accessed, -1 for accesses not bound to a core.
+ * @param accesses -> Number of registers accessed.
+ */
+void statsLeave(const unsigned char previous, const short cpu, const unsigned int accesses) {
+	const uint64_t now = monotonicNs(), elapsed = now - statsMark;
+	unsigned char bucket;
+
+	phaseNs[statsPhase] += elapsed;
+	phaseCount[statsPhase] += accesses;
+	statsMark = now;
+	statsPhase = previous;
+	if (cpu < 0) {
+		return;
+	}
+	for (bucket = 0; bucket < STATS_BUCKETS - 1 && elapsed >= (1000ULL << bucket); bucket++);
+	coreStats[cpu].buckets[bucket]++;
+	coreStats[cpu].count++;
+	coreStats[cpu].total += elapsed;
+	if (elapsed > coreStats[cpu].max) {
+		coreStats[cpu].max = elapsed;
+	}
+}
+
+/**
+ * Print the --stats phase totals and per-core MSR latency histograms to STDERR.
+ * Cores whose mean latency is STATS_OUTLIER times the median of the core means are flagged.
+ */
+void printStats() {
+	uint64_t *means = malloc(cores * sizeof *means), median = 0, total = 0;
+	unsigned short measured = 0;
+	unsigned char i;
+	short cpu;
+
+	statsEnter(PHASE_OUTPUT);
+	fprintf(stderr, "\nPhase               Time (us)   Accesses\n");
+	for (i = 0; i < PHASES; i++) {
+		total += phaseNs[i];
+		fprintf(stderr, "%-18s %11.1f", PHASE_NAMES[i], phaseNs[i] / 1000.0);
+		if (i == PHASE_READS || i == PHASE_WRITES || i == PHASE_PCI) {
+			fprintf(stderr, " %10u", phaseCount[i]);
+		}
+		fprintf(stderr, "\n");
+	}
+	fprintf(stderr, "%-18s %11.1f\n", "Total", total / 1000.0);
+	if (means == NULL) {
+		return;
+	}
+	for (cpu = 0; cpu < cores; cpu++) {
+		if (coreStats[cpu].count) {
+			means[measured++] = coreStats[cpu].total / coreStats[cpu].count;
+		}
+	}
+	if (!measured) {
+		free(means);
+		return;
+	}
+	qsort(means, measured, sizeof *means, compareU64);
+	median = means[measured / 2];
+	fprintf(stderr, "\nMSR latency per core (us), accesses per bucket:\n");
+	fprintf(stderr, "  Core  Count    Mean     Max |");
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		fprintf(stderr, i < STATS_BUCKETS - 1 ? " <%-4d" : " >=%-3d", i < STATS_BUCKETS - 1 ? 1 << i : 1 << (i - 1));
+	}
+	fprintf(stderr, "\n");
+	for (cpu = 0; cpu < cores; cpu++) {
+		if (!coreStats[cpu].count) {
+			continue;
+		}
+		const uint64_t mean = coreStats[cpu].total / coreStats[cpu].count;
+		fprintf(stderr, "%6d %6u %7.1f %7.1f |", cpu, coreStats[cpu].count, mean / 1000.0, coreStats[cpu].max / 1000.0);
+		for (i = 0; i < STATS_BUCKETS; i++) {
+			fprintf(stderr, " %5u", coreStats[cpu].buckets[i]);
+		}
+		fprintf(stderr, "%s\n", measured > 1 && mean > median * STATS_OUTLIER ? "  <- outlier" : "");
+	}
+	free(means);
+}
+
+/**
+ * Estimate how much MSR reads disturb a program running on the core set with -c.
+ * A probe process pinned to the core spins on the monotonic clock and adds up every
+ * gap longer than PERTURB_GAP_NS, once while the core is left alone and once while
+ * amdctl reads its P-State status register PERTURB_ACCESSES times from another core.
+ * Reads go through --budget, so this also shows the bound a budget gives.
+ */
+void measurePerturbation() {
+	const short target = core;
+	const int targetCore = physicalCore(target);
+	const uint64_t interval = PERTURB_DURATION_NS / PERTURB_ACCESSES;
+	uint64_t *results, next;
+	unsigned int accesses = 0, skipped = 0;
+	cpu_set_t oldSet, set;
+	unsigned char phase;
+	pid_t probe, reaped;
+	int status = 0;
+	short reader;
+
+	// Baseline stolen ns, gaps and max gap, then the same with MSR traffic.
+	results = mmap(NULL, 6 * sizeof *results, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		error("Could not allocate memory for the perturbation probe.");
+	}
+	if (sched_getaffinity(0, sizeof oldSet, &oldSet) != 0) {
+		error("Could not get the CPU affinity of amdctl.");
+	}
+	// Read from another physical core, a SMT sibling would slow the probe down by itself.
+	for (reader = 0; reader < cores; reader++) {
+		if (reader != target && CPU_ISSET(reader, &oldSet) && (targetCore == -1 || physicalCore(reader) != targetCore)) {
+			break;
+		}
+	}
+	if (reader == cores) {
+		fprintf(stderr, "ERROR: Option --perturbation needs a CPU core outside of the physical core of CPU core %d.\n", target);
+		exit(EXIT_FAILURE);
+	}
+	CPU_ZERO(&set);
+	CPU_SET(reader, &set);
+	if (sched_setaffinity(0, sizeof set, &set) != 0) {
+		error("Could not move amdctl off the measured CPU core.");
+	}
+	msrFd(target, 1);
+	for (phase = 0; phase < 2; phase++) {
+		probe = fork();
+		if (probe < 0) {
+			error("Could not start the perturbation probe.");
+		}
+		if (probe == 0) {
+			runProbe(target, &results[phase * 3]);
+			_exit(EXIT_SUCCESS);
+		}
+		skipped = skippedReads;
+		reaped = 0;
+		if (phase) {
+			next = monotonicNs();
+			while (!(reaped = waitpid(probe, &status, WNOHANG))) {
+				if (monotonicNs() >= next) {
+					rwMsrReg(MSR_PSTATE_STATUS, 1);
+					accesses++;
+					next += interval;
+				}
+			}
+		}
+		if ((!reaped && waitpid(probe, &status, 0) != probe) || !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+			fprintf(stderr, "ERROR: The perturbation probe could not run on CPU core %d.\n", target);
+			exit(EXIT_FAILURE);
+		}
+	}
+	sched_setaffinity(0, sizeof oldSet, &oldSet);
+	skipped = skippedReads - skipped;
+	if (!quiet) {
+		printf("\nCore %d | Probe gaps over %dus, %dms without MSR reads: %d (%.1fus stolen, longest %.1fus)\n",
+			target, PERTURB_GAP_NS / 1000, PERTURB_DURATION_NS / 1000000, (int) results[1], results[0] / 1000.0, results[2] / 1000.0);
+		printf("Core %d | Probe gaps over %dus, %dms with %d MSR reads (%d served by --budget): %d (%.1fus stolen, longest %.1fus)\n",
+			target, PERTURB_GAP_NS / 1000, PERTURB_DURATION_NS / 1000000, accesses, skipped, (int) results[4], results[3] / 1000.0, results[5] / 1000.0);
+		printf("Core %d | Added latency per MSR read: %.2fus\n",
+			target, accesses > skipped && results[3] > results[0] ? (results[3] - results[0]) / 1000.0 / (accesses - skipped) : 0.0);
+	}
+	munmap(results, 6 * sizeof *results);
+}
+
+/**
+ * Spin on a CPU core for PERTURB_DURATION_NS, adding up the gaps between clock reads.
+ * @param cpu -> The CPU core to run on.
+ * @param results -> Receives the stolen ns, number of gaps and longest gap.
+ */
+void runProbe(const short cpu, uint64_t *results) {
+	cpu_set_t set;
+	uint64_t start, prev, now;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (sched_setaffinity(0, sizeof set, &set) != 0) {
+		_exit(EXIT_FAILURE);
+	}
+	sched_yield();
+	results[0] = results[1] = results[2] = 0;
+	start = prev = monotonicNs();
+	do {
+		now = monotonicNs();
+		if (now - prev > PERTURB_GAP_NS) {
+			results[0] += now - prev;
+			results[1]++;
+			if (now - prev > results[2]) {
+				results[2] = now - prev;
+			}
+		}
+		prev = now;
+	} while (now - start < PERTURB_DURATION_NS);
+}
+
+/**
+ * Watch the P-State registers written by this run and write the fields set with
+ * -a / -n / -v / -f / -d again when they no longer hold the requested values,
+ * for example after firmware restored them on resume from suspend.
+ * Wakes up every watchInterval seconds and when the realtime clock is set, which
+ * the kernel does on resume. A periodic wake up reads one register per watched core,
+ * going round the watched P-States, all of them are only read once that one drifted.
+ * After a resume or clock change every watched register is checked.
+ */
+void watchDrift() {
+	struct itimerspec never = {{0, 0}, {0x7fffffff, 0}};
+	struct pollfd pfd;
+	uint64_t owned, desired, value;
+	int64_t suspended, gap;
+	struct timespec ts;
+	const char *reason;
+	unsigned short watched = 0;
+	unsigned int round = 0;
+	unsigned char ps;
+	short cpu;
+
+	// Fields set by the options are the bits which do not depend on the original value.
+	buffer = 0;
+	applyPstateOptions();
+	desired = buffer;
+	buffer = ~0ULL;
+	applyPstateOptions();
+	owned = ~(desired ^ buffer);
+	desired &= owned;
+
+	for (cpu = 0; cpu < cores; cpu++) {
+		watched += (watchedPstates[cpu] != 0);
+	}
+	if (!watched) {
+		return;
+	}
+	pfd.fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+	pfd.events = POLLIN;
+	if (pfd.fd < 0 || timerfd_settime(pfd.fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &never, NULL) != 0) {
+		error("Could not create the clock change timer for --watch.");
+	}
+	if (!quiet) {
+		logTime();
+		printf("Watching %d cores every %ds (fields 0x%016" PRIx64 " = 0x%016" PRIx64 ")%s\n", watched, watchInterval, owned, desired, testMode ? ", preview only" : "");
+		fflush(stdout);
+	}
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	suspended = (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec - (int64_t) monotonicNs();
+	for (;;) {
+		reason = "interval";
+		if (poll(&pfd, 1, watchInterval * 1000) > 0) {
+			// Reading a timer cancelled by a clock change fails, it has to be armed again.
+			if (read(pfd.fd, &value, sizeof value) < 0) {
+				timerfd_settime(pfd.fd, TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &never, NULL);
+			}
+			reason = "clock change";
+		}
+		// The monotonic clock stops while suspended, the boot time clock does not.
+		clock_gettime(CLOCK_BOOTTIME, &ts);
+		gap = (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec - (int64_t) monotonicNs();
+		if (gap > suspended + 1000000000LL) {
+			reason = "resume";
+		}
+		suspended = gap;
+
+		for (cpu = 0; cpu < cores; cpu++) {
+			if (!watchedPstates[cpu]) {
+				continue;
+			}
+			core = cpu;
+			if (reason[0] == 'i') {
+				unsigned char nth = round % __builtin_popcount(watchedPstates[cpu]);
+				for (ps = 0; !(watchedPstates[cpu] & (1 << ps)) || nth--; ps++);
+				rwMsrReg(MSR_PSTATE_BASE + ps, 1);
+				if ((buffer & owned) == desired) {
+					continue;
+				}
+			}
+			for (ps = 0; ps < PSTATES; ps++) {
+				if (!(watchedPstates[cpu] & (1 << ps))) {
+					continue;
+				}
+				rwMsrReg(MSR_PSTATE_BASE + ps, 1);
+				if ((buffer & owned) == desired) {
+					continue;
+				}
+				value = buffer;
+				buffer = (buffer & ~owned) | desired;
+				rwMsrReg(MSR_PSTATE_BASE + ps, 0);
+				if (!quiet) {
+					logTime();
+					printf(
+						"Core %d | P-State %d drifted (%s): 0x%016" PRIx64 " -> 0x%016" PRIx64 "%s\n",
+						cpu, ps, reason, value, buffer, testMode ? " (preview, not changed)" : ""
+					);
+				}
+			}
+		}
+		fflush(stdout);
+		round++;
+	}
+}
+
+/**
+ * Print the local time, used to prefix --watch log lines.
+ */
+void logTime() {
+	char stamp[32];
+	time_t now = time(NULL);
+	strftime(stamp, sizeof stamp, "%Y-%m-%d %H:%M:%S", localtime(&now));
+	printf("[%s] ", stamp);
+}
+
+/**
+ * Request P-State changes through the P-State control register and spin on the
+ * status register until the new P-State is reported, for every pair of enabled
+ * P-States. The timings include the MSR access overhead. The P-State requested
+ * before the measurement is restored at the end.
+ */
+void measureTransitions() {
+	const unsigned int samples = pollSamples ? pollSamples : TRANSITION_SAMPLES;
+	unsigned char enabled[MAX_PSTATES], count = 0, from, to, missed = 0;
+	uint64_t *times = malloc(samples * sizeof *times), stats[3], original;
+	unsigned int i;
+
+	if (times == NULL) {
+		error("Could not allocate memory for the P-State transition samples.");
+	}
+	rwMsrReg(MSR_PSTATE_CURRENT_LIMIT, 1);
+	const unsigned char lowest = getDec(PSTATE_MAX_VAL_BITS);
+	for (i = 0; i <= lowest && i < PSTATES; i++) {
+		rwMsrReg(MSR_PSTATE_BASE + i, 1);
+		if (getDec(PSTATE_EN_BITS)) {
+			enabled[count++] = i;
+		}
+	}
+	if (count < 2) {
+		error("At least 2 P-States must be enabled to measure transitions.");
+	}
+	rwMsrReg(MSR_PSTATE_CTL, 1);
+	original = buffer;
+	if (!quiet) {
+		printf("\nCore %d | P-State transition latency (%d samples per pair, includes MSR access overhead)%s\n", core, samples, testMode ? " (preview, not measured)" : "");
+		printf("   From     To        Min     Median        P99\n");
+	}
+	for (from = 0; from < count; from++) {
+		for (to = 0; to < count; to++) {
+			if (from == to) {
+				continue;
+			}
+			if (testMode) {
+				if (!quiet) {
+					printf("%7d%7d\n", enabled[from], enabled[to]);
+				}
+				continue;
+			}
+			for (i = 0; i < samples; i++) {
+				buffer = original;
+				updateBuffer(PSTATE_CMD_BITS, enabled[from]);
+				rwMsrReg(MSR_PSTATE_CTL, 0);
+				if (!waitForPstate(enabled[from], monotonicNs(), NULL)) {
+					missed = enabled[from];
+					break;
+				}
+				buffer = original;
+				updateBuffer(PSTATE_CMD_BITS, enabled[to]);
+				// Timed from before the request, the control register write is part of the transition.
+				const uint64_t start = monotonicNs();
+				rwMsrReg(MSR_PSTATE_CTL, 0);
+				if (!waitForPstate(enabled[to], start, &times[i])) {
+					missed = enabled[to];
+					break;
+				}
+			}
+			if (i < samples) {
+				buffer = original;
+				rwMsrReg(MSR_PSTATE_CTL, 0);
+				fprintf(stderr, "ERROR: Core %d did not reach P-State %d within %dms, is a cpufreq governor changing P-States?\n", core, missed, TRANSITION_TIMEOUT_NS / 1000000);
+				exit(EXIT_FAILURE);
+			}
+			latencyStats(times, samples, stats);
+			if (!quiet) {
+				printf("%7d%7d%9.2fus%9.2fus%9.2fus\n", enabled[from], enabled[to], stats[0] / 1000.0, stats[1] / 1000.0, stats[2] / 1000.0);
+			}
+		}
+	}
+	buffer = original;
+	rwMsrReg(MSR_PSTATE_CTL, 0);
+	free(times);
+}
+
+/**
+ * Spin on the P-State status register (COFVID status before 17h) of the current core.
+ * @param target -> The P-State to wait for.
+ * @param start -> Monotonic time the P-State was requested at, the timeout counts from it.
+ * @param elapsed -> Receives the nanoseconds since start, can be NULL.
+ * @return unsigned char -> 1 if the P-State was reached, 0 on timeout.
+ */
+unsigned char waitForPstate(const unsigned char target, const uint64_t start, uint64_t *elapsed) {
+	const unsigned char zen = (cpuFamily == AMD17H || cpuFamily == AMD19H);
+	uint64_t now;
+	do {
+		rwMsrReg(zen ? MSR_PSTATE_STATUS : MSR_COFVID_STATUS, 1);
+		now = monotonicNs();
+		if (getDec(zen ? CUR_PSTATE_BITS : COFVID_CUR_PSTATE_BITS) == target) {
+			if (elapsed != NULL) {
+				*elapsed = now - start;
+			}
+			return 1;
+		}
+	} while (now - start < TRANSITION_TIMEOUT_NS);
+	return 0;
+}
+
+/**
+ * Iterate CPU cores, get/set PState values.
+ * Only the registers needed for the requested fields / writes are read.
+ */
+void wrCpuStates() {
+	uint32_t tmp_pstates[PSTATES];
+	unsigned char pstates_count = 0;
+	if (pstate == -1) {
+		for (; pstates_count < PSTATES; pstates_count++) {
+			tmp_pstates[pstates_count] = (MSR_PSTATE_BASE + pstates_count);
+		}
+	} else { // User only requested 1 PState.
+		tmp_pstates[0] = MSR_PSTATE_BASE + pstate;
+		pstates_count = 1;
+	}
+
+	const unsigned char writing = (nbVid > -1 || cpuVid > -1 || cpuFid > -1 || cpuDid > -1 || togglePs > -1);
+	if (quiet && !writing) {
+		return;
+	}
+	const unsigned char zen = (cpuFamily == AMD17H || cpuFamily == AMD19H);
+	const unsigned char showHeader = (!quiet && !customFields);
+	// The lowest P-State limit decides how many P-States are iterated.
+	const unsigned char readLimits = (showHeader || (pstate == -1 && !currentOnly));
+	const unsigned char readPstates = (writing || (!quiet && (fields & FIELDS_PSTATE_REG)));
+	// With --fields the current row has no label of its own, it is only shown with -e or the pstate column.
+	const unsigned char showCurrent = (!quiet && (fields & FIELDS_COFVID_REG) && (!customFields || currentOnly || (fields & FIELD_PSTATE)));
+
+	static unsigned char printedHeader = 0;
+	uint32_t regs[MAX_BATCH_REGS];
+	unsigned char regCount = 0;
+
+	// Read everything the loop below needs in one batch.
+	if (readLimits) {
+		regs[regCount++] = MSR_PSTATE_CURRENT_LIMIT;
+	}
+	if (showHeader) {
+		regs[regCount++] = MSR_PSTATE_STATUS;
+		regs[regCount++] = MSR_HWCR;
+		if (zen) {
+			regs[regCount++] = MSR_CSTATE_CONFIG;
+			regs[regCount++] = MSR_PMGT_MISC;
+		}
+	}
+	if (readPstates && !currentOnly) {
+		memcpy(&regs[regCount], tmp_pstates, pstates_count * sizeof *tmp_pstates);
+		regCount += pstates_count;
+	}
+	if (showCurrent) {
+		regs[regCount++] = currentStateReg();
+	}
+	batchReadMsrs(regs, regCount);
+
+	if (!quiet && customFields && !printedHeader) {
+		printFieldsHeader();
+		printedHeader = 1;
+	}
+	for (; core < cores; core = nextCore(core + 1)) {
+		int i, curPstate = 0, minPstate = PSTATES, maxPstate = 0;
+		if (readLimits) {
+			rwMsrReg(MSR_PSTATE_CURRENT_LIMIT, 1);
+			minPstate = getDec(PSTATE_MAX_VAL_BITS);
+			maxPstate = getDec(CUR_PSTATE_LIMIT_BITS);
+			if (!zen) {
+				minPstate++;
+				maxPstate++;
+			}
+		}
+		if (showHeader) {
+			rwMsrReg(MSR_PSTATE_STATUS, 1);
+			curPstate = getDec(CUR_PSTATE_BITS) + (zen ? 0 : 1);
+			rwMsrReg(MSR_HWCR, 1);
+			printf(
+				"\nCore %d | P-State Limits (non-turbo): Highest: %d ; Lowest %d | Current P-State: %d | Boost: %s",
+				core, maxPstate, minPstate, curPstate, getDec(CPB_DIS_BITS) ? "Off" : "On"
+			);
+			if (zen) {
+				printf(" | CC6: %s", getCc6() ? "On" : "Off");
+				rwMsrReg(MSR_PMGT_MISC, 1);
+				printf(" | PC6: %s", getDec(PC6_EN_BITS) ? "On" : "Off");
+			}
+			printf("\n");
+			printFieldsHeader();
+		}
+		if (!currentOnly) {
+			for (i = 0; i < pstates_count; i++) {
+				if (readPstates) {
+					rwMsrReg(tmp_pstates[i], 1);
+				}
+				if (writing) {
+					applyPstateOptions();
 					rwMsrReg(tmp_pstates[i], 0);
+					if (watchInterval) {
+						watchedPstates[core] |= 1 << (tmp_pstates[i] - MSR_PSTATE_BASE);
+					}
+				}
+				if (!quiet) {
+					printRowPrefix(NULL, (pstate >= 0 ? pstate : i));
+					printCpuPstate(1);
 				}
-				printCpuPstate(1);
 				if (i >= minPstate) {
 					break;
 				}
 			}
 		}
-		switch (cpuFamily) {
-			case AMD17H:
-			case AMD19H:
+		if (showCurrent) {
+			printRowPrefix("current", 0);
+			rwMsrReg(currentStateReg(), 1);
+			printCpuPstate(0);
+		}
+	}
+	clearMsrCache();
+}
+
+/**
+ * @return uint32_t -> The register holding the live CPU fid / did / vid.
+ *                     Same bit layout as the P-State registers on every family.
+ */
+uint32_t currentStateReg() {
+	return (cpuFamily == AMD17H || cpuFamily == AMD19H) ? MSR_HW_PSTATE_STATUS : MSR_COFVID_STATUS;
+}
+
+/**
+ * Repeatedly read only the current state register of the selected cores and
+ * print one row per core, every pollInterval milliseconds.
+ */
+void pollCurrentStates() {
+	const short firstCore = core;
+	const uint32_t reg = currentStateReg();
+	unsigned int sample;
+
+	if (quiet) {
+		return;
+	}
+	fields = (fields | FIELD_CORE) & ~(FIELD_STATUS | FIELDS_IDD);
+	printFieldsHeader();
+	for (sample = 0; !pollSamples || sample < pollSamples; sample++) {
+		if (sample) {
+			usleep(pollInterval * 1000);
+		}
+		core = firstCore;
+		batchReadMsrs(&reg, 1);
+		for (core = firstCore; core < cores; core = nextCore(core + 1)) {
+			rwMsrReg(reg, 1);
+			printRowPrefix("current", 0);
+			printCpuPstate(0);
+		}
+		fflush(stdout);
+	}
+	clearMsrCache();
+	core = firstCore;
+}
+
+/**
+ * Print the effective frequency and C0 residency of the selected cores and the power of
+ * their packages every monitorInterval milliseconds. The counters are read with one read
+ * per core (a perf counter group of APERF, MPERF and TSC) and one per package, from the
+ * MSR devices when the perf PMUs can not be used, or for a core whose group can not be opened.
+ * The kernel still reads the group with an IPI to its core, one per group instead of one per MSR.
+ * Both backends derive the frequency the same way: TSC rate * APERF / MPERF, MPERF counting
+ * at the TSC rate while in C0.
+ */
+void monitorCores() {
+	const short firstCore = core, span = cores - core;
+	const unsigned char rapl = (cpuFamily == AMD17H || cpuFamily == AMD19H);
+	uint64_t (*counters)[MONITOR_COUNTERS] = calloc(span, sizeof *counters), *energy = calloc(cores, sizeof *energy);
+	int (*fds)[MONITOR_COUNTERS] = malloc(span * sizeof *fds), *energyFds = malloc(cores * sizeof *energyFds);
+	short *socketCore = malloc(cores * sizeof *socketCore);
+	struct {
+		uint64_t nr;
+		uint64_t values[MONITOR_COUNTERS];
+	} group;
+	const char *names[] = {"aperf", "mperf", "tsc"};
+	const uint32_t regs[] = {MSR_APERF, MSR_MPERF, MSR_TSC};
+	double energyUnit = 0;
+	uint64_t last = 0, now, value;
+	unsigned int sample;
+	unsigned char i;
+	short cpu, socket;
+	char path[96];
+
+	if (counters == NULL || energy == NULL || fds == NULL || energyFds == NULL || socketCore == NULL) {
+		error("Could not allocate memory for --monitor.");
+	}
+	memset(socketCore, 0xff, cores * sizeof *socketCore);
+	memset(energyFds, 0xff, cores * sizeof *energyFds);
+	for (cpu = firstCore; cpu < cores; cpu = nextCore(cpu + 1)) {
+		snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		socket = readSysfsInt(path);
+		socket = (socket < 0 || socket >= cores) ? 0 : socket;
+		if (socketCore[socket] == -1) {
+			socketCore[socket] = cpu;
+		}
+		if (!usePerf) {
+			continue;
+		}
+		if (socketCore[socket] == cpu) {
+			energyFds[socket] = perfEvent("power", "energy-pkg", cpu, -1, &energyUnit);
+		}
+		for (i = 0; i < MONITOR_COUNTERS; i++) {
+			fds[cpu - firstCore][i] = perfEvent("msr", names[i], cpu, i ? fds[cpu - firstCore][0] : -1, NULL);
+			if (fds[cpu - firstCore][i] < 0) {
 				break;
-			default:
-				if (!quiet) {
-					printf("%7s", "current");
+			}
+		}
+		if (i == MONITOR_COUNTERS) {
+			continue;
+		}
+		// Read this core from its MSR device, which needs root unlike the PMUs.
+		if (geteuid() != 0) {
+			fprintf(stderr, "ERROR: Could not open the perf msr/%s/ counter of CPU core %d, reading its MSR device needs root access.\n", names[i], cpu);
+			exit(EXIT_FAILURE);
+		}
+		while (i--) {
+			close(fds[cpu - firstCore][i]);
+		}
+		fds[cpu - firstCore][0] = -1;
+		if (!quiet) {
+			printf("Reading the counters of CPU core %d through its MSR device.\n", cpu);
+		}
+	}
+	if (!usePerf && rapl) {
+		core = firstCore;
+		rwMsrReg(MSR_RAPL_PWR_UNIT, 1);
+		energyUnit = 1.0 / (1ULL << getDec(RAPL_ENERGY_UNIT_BITS));
+	}
+
+	if (!quiet) {
+		printf("Reading counters through %s.\n", usePerf ? "the perf msr / power PMUs" : "the MSR devices");
+		printf("  Core     EffFreq      C0\n");
+	}
+	for (sample = 0; !pollSamples || sample <= pollSamples; sample++) {
+		if (sample) {
+			usleep(monitorInterval * 1000);
+		}
+		now = monotonicNs();
+		for (cpu = firstCore; cpu < cores; cpu = nextCore(cpu + 1)) {
+			uint64_t *previous = counters[cpu - firstCore], delta[MONITOR_COUNTERS];
+			if (usePerf && fds[cpu - firstCore][0] > -1) {
+				if (read(fds[cpu - firstCore][0], &group, sizeof group) != sizeof group) {
+					fprintf(stderr, "ERROR: Could not read the perf counters of CPU core %d.\n", cpu);
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				core = cpu;
+				for (i = 0; i < MONITOR_COUNTERS; i++) {
+					rwMsrReg(regs[i], 1);
+					group.values[i] = buffer;
 				}
-				rwMsrReg(MSR_COFVID_STATUS, 1);
-				printCpuPstate(0);
+			}
+			for (i = 0; i < MONITOR_COUNTERS; i++) {
+				delta[i] = group.values[i] - previous[i];
+				previous[i] = group.values[i];
+			}
+			if (!sample || quiet) {
+				continue;
+			}
+			printf(
+				"%6d %9.2fMHz %6.2f%%\n", cpu,
+				delta[1] ? (double) delta[2] * 1000.0 / (now - last) * delta[0] / delta[1] : 0.0,
+				delta[2] ? delta[1] * 100.0 / delta[2] : 0.0
+			);
+		}
+		for (socket = 0; socket < cores; socket++) {
+			if (socketCore[socket] == -1 || (usePerf ? energyFds[socket] < 0 : !rapl)) {
+				continue;
+			}
+			if (usePerf) {
+				if (read(energyFds[socket], &group, 2 * sizeof value) != 2 * sizeof value) {
+					fprintf(stderr, "ERROR: Could not read the perf energy counter of socket %d.\n", socket);
+					exit(EXIT_FAILURE);
+				}
+				value = group.values[0];
+			} else {
+				core = socketCore[socket];
+				rwMsrReg(MSR_PKG_ENERGY_STAT, 1);
+				value = getDec(PKG_ENERGY_BITS);
+			}
+			// The MSR counter is 32 bits wide and wraps.
+			const uint64_t used = usePerf ? value - energy[socket] : (value - energy[socket]) & 0xffffffffULL;
+			energy[socket] = value;
+			if (sample && !quiet) {
+				printf("Socket %d | Package: %.2fW\n", socket, used * energyUnit * 1000000000.0 / (now - last));
+			}
+		}
+		last = now;
+		fflush(stdout);
+	}
+	for (cpu = firstCore; usePerf && cpu < cores; cpu = nextCore(cpu + 1)) {
+		for (i = 0; fds[cpu - firstCore][0] > -1 && i < MONITOR_COUNTERS; i++) {
+			close(fds[cpu - firstCore][i]);
+		}
+	}
+	for (socket = 0; socket < cores; socket++) {
+		if (energyFds[socket] > -1) {
+			close(energyFds[socket]);
+		}
+	}
+	core = firstCore;
+	free(counters);
+	free(energy);
+	free(fds);
+	free(energyFds);
+	free(socketCore);
+}
+
+/**
+ * Open a counter of a kernel perf PMU on a CPU, reading its type and event from sysfs.
+ * Counters of the msr and power PMUs count the whole CPU, for every process.
+ * @param pmu -> The PMU, like msr or power.
+ * @param event -> The event name, like aperf or energy-pkg.
+ * @param cpu -> The CPU core to count on.
+ * @param group -> The group leader, -1 to open a new group. A read of the leader returns
+ *                 the number of counters followed by each counter value.
+ * @param scale -> If not NULL, receives the event scale (joules per count for energy events).
+ * @return int -> The file descriptor, -1 if the counter is not available.
+ */
+int perfEvent(const char *pmu, const char *event, const short cpu, const int group, double *scale) {
+	struct perf_event_attr attr;
+	long long config;
+	char path[PATH_MAX];
+	FILE *fp;
+	int type;
+
+	snprintf(path, sizeof path, PERF_PMU_DIR "/%s/type", pmu);
+	if ((type = readSysfsInt(path)) < 0) {
+		return -1;
+	}
+	snprintf(path, sizeof path, PERF_PMU_DIR "/%s/events/%s", pmu, event);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	if (fscanf(fp, "event=%lli", &config) != 1) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+	if (scale != NULL) {
+		snprintf(path, sizeof path, PERF_PMU_DIR "/%s/events/%s.scale", pmu, event);
+		fp = fopen(path, "r");
+		if (fp == NULL || fscanf(fp, "%lf", scale) != 1) {
+			*scale = 1.0;
+		}
+		if (fp != NULL) {
+			fclose(fp);
+		}
+	}
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = type;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	return syscall(__NR_perf_event_open, &attr, -1, cpu, group, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Read the P-State registers of every core, group cores with identical registers
+ * and print each distinct P-State table once, followed by the outliers.
+ * Runs in linear time. The hash table holds two bytes per core, the groups and
+ * their range lists grow with the number of distinct tables.
+ */
+void summarizeCpuStates() {
+	const unsigned char zen = (cpuFamily == AMD17H || cpuFamily == AMD19H);
+	const unsigned char regCount = (pstate == -1 ? PSTATES : 1) + 1;
+	const unsigned short selected = selectedCount();
+	unsigned int tableSize = 1, slot;
+	unsigned short groupCount = 0, groupSize = 4, largest = 0, i, *table;
+	unsigned char j;
+	pstateGroup *groups, *group;
+	uint64_t regs[MAX_PSTATES + 1], hash;
+	uint32_t regList[MAX_PSTATES + 1];
+
+	if (quiet) {
+		return;
+	}
+	while (tableSize < 2U * selected) {
+		tableSize <<= 1;
+	}
+	table = malloc(tableSize * sizeof *table);
+	groups = malloc(groupSize * sizeof *groups);
+	if (table == NULL || groups == NULL) {
+		error("Could not allocate memory for the P-State summary.");
+	}
+	memset(table, 0xff, tableSize * sizeof *table);
+	regList[0] = MSR_PSTATE_CURRENT_LIMIT;
+	for (j = 1; j < regCount; j++) {
+		regList[j] = MSR_PSTATE_BASE + (pstate == -1 ? j - 1 : pstate);
+	}
+	batchReadMsrs(regList, regCount);
+
+	for (; core < cores; core = nextCore(core + 1)) {
+		for (j = 0; j < regCount; j++) {
+			rwMsrReg(regList[j], 1);
+			regs[j] = buffer;
+		}
+		// FNV-1a over the raw register values.
+		hash = 0xcbf29ce484222325ULL;
+		for (j = 0; j < regCount; j++) {
+			hash = (hash ^ regs[j]) * 0x100000001b3ULL;
+		}
+		for (slot = hash & (tableSize - 1); table[slot] != 0xffff; slot = (slot + 1) & (tableSize - 1)) {
+			group = &groups[table[slot]];
+			if (group->hash == hash && !memcmp(group->regs, regs, regCount * sizeof regs[0])) {
 				break;
+			}
+		}
+		if (table[slot] == 0xffff) {
+			if (groupCount == groupSize) {
+				groupSize *= 2;
+				groups = realloc(groups, groupSize * sizeof *groups);
+				if (groups == NULL) {
+					error("Could not allocate memory for the P-State summary.");
+				}
+			}
+			table[slot] = groupCount;
+			group = &groups[groupCount++];
+			memcpy(group->regs, regs, regCount * sizeof regs[0]);
+			group->hash = hash;
+			group->members = 0;
+			group->rangeCount = group->rangeSize = 0;
+			group->ranges = NULL;
+		}
+		group = &groups[table[slot]];
+		group->members++;
+		// Cores are visited in order, so a core either extends the last range or starts a new one.
+		if (group->rangeCount && group->ranges[group->rangeCount - 1][1] == core - 1) {
+			group->ranges[group->rangeCount - 1][1] = core;
+		} else {
+			if (group->rangeCount == group->rangeSize) {
+				group->rangeSize = group->rangeSize ? group->rangeSize * 2 : 4;
+				group->ranges = realloc(group->ranges, group->rangeSize * sizeof *group->ranges);
+				if (group->ranges == NULL) {
+					error("Could not allocate memory for the P-State summary.");
+				}
+			}
+			group->ranges[group->rangeCount][0] = group->ranges[group->rangeCount][1] = core;
+			group->rangeCount++;
+		}
+		if (group->members > groups[largest].members) {
+			largest = table[slot];
+		}
+	}
+	free(table);
+	clearMsrCache();
+
+	for (i = 0; i < groupCount; i++) {
+		const unsigned short g = (i == 0 ? largest : (i <= largest ? i - 1 : i));
+		group = &groups[g];
+		if (i == 1) {
+			printf("\nOutliers: %d distinct P-State table%s on %d core%s.\n", groupCount - 1, groupCount > 2 ? "s" : "",
+				selected - groups[largest].members, selected - groups[largest].members > 1 ? "s" : "");
+		}
+		buffer = group->regs[0];
+		int minPstate = getDec(PSTATE_MAX_VAL_BITS) + (zen ? 0 : 1);
+		printf("\n%s (%d of %d): ", group->members > 1 ? "Cores" : "Core", group->members, selected);
+		printCoreRanges(group);
+		printf(" | P-State Limits (non-turbo): Highest: %d ; Lowest %d\n", getDec(CUR_PSTATE_LIMIT_BITS) + (zen ? 0 : 1), minPstate);
+		printFieldsHeader();
+		for (j = 1; j < regCount; j++) {
+			buffer = group->regs[j];
+			printRowPrefix(NULL, (pstate >= 0 ? pstate : j - 1));
+			printCpuPstate(1);
+			if (j - 1 >= minPstate) {
+				break;
+			}
+		}
+		free(group->ranges);
+	}
+	free(groups);
+}
+
+/**
+ * Print the cores of a group as a compact range list, for example 0-63,128-191.
+ * @param group -> The group to print.
+ */
+void printCoreRanges(const pstateGroup *group) {
+	unsigned short i;
+	for (i = 0; i < group->rangeCount; i++) {
+		if (group->ranges[i][0] == group->ranges[i][1]) {
+			printf("%s%d", i ? "," : "", group->ranges[i][0]);
+		} else {
+			printf("%s%d-%d", i ? "," : "", group->ranges[i][0], group->ranges[i][1]);
+		}
+	}
+}
+
+/**
+ * Print the column names of the selected fields to STDOUT.
+ */
+void printFieldsHeader() {
+	unsigned char i;
+	for (i = 0; i < sizeof FIELD_LIST / sizeof FIELD_LIST[0]; i++) {
+		if (fields & FIELD_LIST[i].field) {
+			printf("%s", FIELD_LIST[i].header);
+		}
+	}
+	printf("\n");
+}
+
+/**
+ * Print the core / P-State columns which start a row.
+ * @param name -> Name to print in the P-State column, NULL to print the number.
+ * @param ps -> The P-State number.
+ */
+void printRowPrefix(const char *name, const int ps) {
+	if (fields & FIELD_CORE) {
+		printf("%6d ", core);
+	}
+	if (fields & FIELD_PSTATE) {
+		if (name != NULL) {
+			printf("%7s", name);
+		} else {
+			printf("%7d", ps);
 		}
 	}
 }
 
 /**
- * Print CPU PState data to STDOUT.
+ * Print CPU PState data to STDOUT, only decoding the selected fields.
  * @param idd -> Print CPU current/power draw or not.
  */
 void printCpuPstate(const unsigned char idd) {
-	const unsigned char status = (idd ? getDec(PSTATE_EN_BITS) : 1);
-	const unsigned short CpuVid = getDec(CPU_VID_BITS), CpuDid = getDec(CPU_DID_BITS), CpuFid = getDec(CPU_FID_BITS);
-	const unsigned short CpuVolt = vidTomV(CpuVid);
-	if (!quiet) {
-		if ((cpuFamily == AMD17H || cpuFamily == AMD19H) && !CpuVid) {
-			printf(" disabled\n");
-			return;
-		}
-		printf(
-			"%7d%7d%7d%7d%8.2fx%9.2fMHz%6dmV",
-			status, CpuFid, CpuDid, CpuVid, getCoreMultiplier(CpuFid, CpuDid), getClockSpeed(CpuFid, CpuDid), CpuVolt
-		);
+	if (!(fields & FIELDS_PSTATE_REG)) {
+		printf("\n");
+		return;
 	}
-	if (idd) {
-		short IddDiv = getDec(IDD_DIV_BITS), IddVal = getDec(IDD_VALUE_BITS);
-		switch (IddDiv) {
-			case 0:
-				IddDiv = 1;
-				break;
-			case 1:
-				IddDiv = 10;
-				break;
-			case 2:
-				IddDiv = 100;
-				break;
-			case 3:
-			default:
-				IddDiv = -1;
-				break;
+	const unsigned short CpuVid = getDec(CPU_VID_BITS);
+	if ((cpuFamily == AMD17H || cpuFamily == AMD19H) && !CpuVid) {
+		printf(" disabled\n");
+		return;
+	}
+	unsigned short CpuDid = 0, CpuFid = 0, CpuVolt = 0;
+	if (fields & (FIELD_FID | FIELD_DID | FIELD_MULT | FIELD_FREQ)) {
+		CpuDid = getDec(CPU_DID_BITS);
+		CpuFid = getDec(CPU_FID_BITS);
+	}
+	if (fields & (FIELD_VOLT | FIELD_POWER)) {
+		CpuVolt = vidTomV(CpuVid);
+	}
+	if (fields & FIELD_STATUS) {
+		printf("%7d", (idd ? getDec(PSTATE_EN_BITS) : 1));
+	}
+	if (fields & FIELD_FID) {
+		printf("%7d", CpuFid);
+	}
+	if (fields & FIELD_DID) {
+		printf("%7d", CpuDid);
+	}
+	if (fields & FIELD_VID) {
+		printf("%7d", CpuVid);
+	}
+	if (fields & FIELD_MULT) {
+		printf("%8.2fx", getCoreMultiplier(CpuFid, CpuDid));
+	}
+	if (fields & FIELD_FREQ) {
+		printf("%9.2fMHz", getClockSpeed(CpuFid, CpuDid));
+	}
+	if (fields & FIELD_VOLT) {
+		printf("%6dmV", CpuVolt);
+	}
+	if (fields & FIELDS_IDD) {
+		short IddDiv = -1, IddVal = 0;
+		if (idd) {
+			IddVal = getDec(IDD_VALUE_BITS);
+			switch (getDec(IDD_DIV_BITS)) {
+				case 0:
+					IddDiv = 1;
+					break;
+				case 1:
+					IddDiv = 10;
+					break;
+				case 2:
+					IddDiv = 100;
+					break;
+				case 3:
+				default:
+					break;
+			}
 		}
 		if (IddDiv != -1) {
 			float cpuCurrDraw = (cpuFamily == AMD17H || cpuFamily == AMD19H) ? IddVal + IddDiv : ((float) IddVal / (float) IddDiv);
-			if (!quiet) {
-				printf("%7d%7d%7.2fA%8.2fW", IddVal, IddDiv, cpuCurrDraw, ((cpuCurrDraw * CpuVolt) / 1000));
+			if (fields & FIELD_IDDVAL) {
+				printf("%7d", IddVal);
+			}
+			if (fields & FIELD_IDDDIV) {
+				printf("%7d", IddDiv);
+			}
+			if (fields & FIELD_CURR) {
+				printf("%7.2fA", cpuCurrDraw);
 			}
+			if (fields & FIELD_POWER) {
+				printf("%8.2fW", ((cpuCurrDraw * CpuVolt) / 1000));
+			}
+		} else if (fields & (FIELD_NBVID | FIELD_NBVOLT)) { // Keep the north bridge columns aligned.
+			printf("%*s", ((fields & FIELD_IDDVAL) ? 7 : 0) + ((fields & FIELD_IDDDIV) ? 7 : 0) + ((fields & FIELD_CURR) ? 8 : 0) + ((fields & FIELD_POWER) ? 9 : 0), "");
 		}
 	}
-	if (!quiet) {
-		if (cpuFamily == AMD10H || cpuFamily == AMD11H) {
-			const int NbVid = getDec(NB_VID_BITS);
-			if (!idd) {
-				printf("%7s%7s%8s%9s", "", "", "", "");
-			}
-			printf("%6d%5dmV", NbVid, vidTomV(NbVid));
+	if (fields & (FIELD_NBVID | FIELD_NBVOLT)) {
+		const int NbVid = getDec(NB_VID_BITS);
+		if (fields & FIELD_NBVID) {
+			printf("%6d", NbVid);
+		}
+		if (fields & FIELD_NBVOLT) {
+			printf("%5dmV", vidTomV(NbVid));
 		}
-		printf("\n");
 	}
+	printf("\n");
 }
 
 /**
  * Print North Bridge PState data to STDOUT.
  */
 void printNbStates() {
-	if (quiet) {
+	if (quiet || customFields) {
 		return;
 	}
 	switch (cpuFamily) {
@@ -749,12 +3265,12 @@ int getDec(const char *loc) {
 
 /**
  * Read or write data (from buffer variable) to a MSR at specified register.
+ * Reads are served from the batch read cache when it holds the register.
  * @param reg -> Register to read or write to.
  * @param read -> 1 to read data, 0 to write data.
  */
 void rwMsrReg(const uint32_t reg, const unsigned char read) {
-	char path[32];
-	int fh;
+	unsigned char i;
 
 	if (debug && !quiet) {
 		printf("DEBUG: %sing data from CPU %d at register %x\n", read ? "Read" : "Writ", core, reg);
@@ -764,19 +3280,374 @@ void rwMsrReg(const uint32_t reg, const unsigned char read) {
 		return;
 	}
 
-	sprintf(path, "/dev/cpu/%d/msr", core);
-	fh = open(path, read ? O_RDONLY : O_WRONLY);
-	if (fh < 0) {
-		fprintf(stderr, "ERROR: Could not open %s for %sing! Is the msr kernel module loaded?\n", path, read ? "read" : "writ");
+	for (i = 0; i < msrCache.count; i++) {
+		if (msrCache.regs[i] == reg && core >= msrCache.firstCore && core < cores) {
+			if (read) {
+				buffer = msrCache.values[(core - msrCache.firstCore) * msrCache.count + i];
+				return;
+			}
+			msrCache.values[(core - msrCache.firstCore) * msrCache.count + i] = buffer;
+			break;
+		}
+	}
+
+	if (read) {
+		readMsr(core, reg, &buffer);
+		return;
+	}
+	const unsigned char phase = stats ? statsEnter(PHASE_WRITES) : 0;
+	if (pwrite(msrFd(core, read), &buffer, sizeof buffer, reg) != sizeof buffer) {
+		fprintf(stderr, "ERROR: Could not write data to %s/%d/msr\n", msrDir, core);
 		exit(EXIT_FAILURE);
 	}
+	if (stats) {
+		statsLeave(phase, core, 1);
+	}
+}
 
-	ssize_t psize = read ? pread(fh, &buffer, 8, reg) : pwrite(fh, &buffer, sizeof buffer, reg);
-	close(fh);
-	if (psize != sizeof buffer) {
-		fprintf(stderr, "ERROR: Could not %s data to %s\n", read ? "read" : "write", path);
+/**
+ * Read a MSR of a core. With --budget, once the core used up its reads for the
+ * current second the last value read from the register is returned instead, a
+ * register not read before waits until the core has a read left.
+ * @param cpu -> The CPU core.
+ * @param reg -> The register to read.
+ * @param value -> Receives the register value.
+ */
+void readMsr(const short cpu, const uint32_t reg, uint64_t *value) {
+	static struct {
+		double tokens;
+		uint64_t refilled;
+		unsigned short count, size;
+		uint32_t *regs;
+		uint64_t *values;
+	} *budgets = NULL;
+	unsigned short i;
+	struct timespec wait;
+
+	if (msrBudget) {
+		if (budgets == NULL) {
+			budgets = calloc(cores, sizeof *budgets);
+			if (budgets == NULL) {
+				error("Could not allocate memory for the MSR budget.");
+			}
+		}
+		// Token bucket, refills at msrBudget tokens per second up to msrBudget.
+		const uint64_t now = monotonicNs();
+		if (!budgets[cpu].refilled) {
+			budgets[cpu].tokens = msrBudget;
+		} else {
+			budgets[cpu].tokens += (now - budgets[cpu].refilled) * (double) msrBudget / 1000000000.0;
+			if (budgets[cpu].tokens > msrBudget) {
+				budgets[cpu].tokens = msrBudget;
+			}
+		}
+		budgets[cpu].refilled = now;
+		for (i = 0; i < budgets[cpu].count && budgets[cpu].regs[i] != reg; i++);
+		if (budgets[cpu].tokens < 1.0 && i < budgets[cpu].count) {
+			*value = budgets[cpu].values[i];
+			skippedReads++;
+			return;
+		}
+		if (budgets[cpu].tokens < 1.0) {
+			// Nothing to serve it from, wait for the bucket to refill one read.
+			const uint64_t delay = (1.0 - budgets[cpu].tokens) * 1000000000.0 / msrBudget + 1;
+			wait.tv_sec = delay / 1000000000;
+			wait.tv_nsec = delay % 1000000000;
+			while (nanosleep(&wait, &wait) == -1 && errno == EINTR);
+			const uint64_t woken = monotonicNs();
+			budgets[cpu].tokens += (woken - budgets[cpu].refilled) * (double) msrBudget / 1000000000.0;
+			budgets[cpu].refilled = woken;
+		}
+		budgets[cpu].tokens -= 1.0;
+	}
+	const unsigned char phase = stats ? statsEnter(PHASE_READS) : 0;
+	if (pread(msrFd(cpu, 1), value, 8, reg) != 8) {
+		fprintf(stderr, "ERROR: Could not read data from %s/%d/msr\n", msrDir, cpu);
 		exit(EXIT_FAILURE);
 	}
+	if (stats) {
+		statsLeave(phase, cpu, 1);
+	}
+	if (msrBudget) {
+		for (i = 0; i < budgets[cpu].count && budgets[cpu].regs[i] != reg; i++);
+		if (i == budgets[cpu].count) {
+			// Grows with the registers read, so every one of them stays capped.
+			if (budgets[cpu].count == budgets[cpu].size) {
+				budgets[cpu].size = budgets[cpu].size ? budgets[cpu].size * 2 : 8;
+				budgets[cpu].regs = realloc(budgets[cpu].regs, budgets[cpu].size * sizeof *budgets[cpu].regs);
+				budgets[cpu].values = realloc(budgets[cpu].values, budgets[cpu].size * sizeof *budgets[cpu].values);
+				if (budgets[cpu].regs == NULL || budgets[cpu].values == NULL) {
+					error("Could not allocate memory for the MSR budget.");
+				}
+			}
+			budgets[cpu].regs[budgets[cpu].count++] = reg;
+		}
+		budgets[cpu].values[i] = *value;
+	}
+}
+
+/**
+ * Get the file descriptor of the MSR device of a core, opening it on first use.
+ * The descriptors stay open for later accesses.
+ * @param cpu -> The CPU core.
+ * @param read -> 1 for reading, 0 for writing.
+ * @return int -> The file descriptor.
+ */
+int msrFd(const short cpu, const unsigned char read) {
+	static int *msrFds[2] = {NULL, NULL};
+	static short msrFdCount = 0;
+	char path[PATH_MAX];
+
+	if (msrFds[0] == NULL) {
+		msrFdCount = cores;
+		msrFds[0] = malloc(msrFdCount * sizeof(int));
+		msrFds[1] = malloc(msrFdCount * sizeof(int));
+		if (msrFds[0] == NULL || msrFds[1] == NULL) {
+			error("Could not allocate memory for the MSR file descriptors.");
+		}
+		memset(msrFds[0], 0xff, msrFdCount * sizeof(int));
+		memset(msrFds[1], 0xff, msrFdCount * sizeof(int));
+	}
+	if (cpu >= msrFdCount) {
+		error("CPU core out of range for the MSR file descriptors.");
+	}
+	if (msrFds[read][cpu] < 0) {
+		snprintf(path, sizeof path, "%s/%d/msr", msrDir, cpu);
+		msrFds[read][cpu] = open(path, read ? O_RDONLY : O_WRONLY);
+		if (msrFds[read][cpu] < 0) {
+			fprintf(stderr, "ERROR: Could not open %s for %sing! Is the msr kernel module loaded?\n", path, read ? "read" : "writ");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return msrFds[read][cpu];
+}
+
+/**
+ * Read a list of registers on every selected core in one batch, from the core variable on.
+ * Later rwMsrReg() reads of these registers are served from the batch until clearMsrCache().
+ * Uses io_uring when available, pread otherwise.
+ * @param regs -> The registers to read.
+ * @param count -> Number of registers, at most MAX_BATCH_REGS.
+ */
+void batchReadMsrs(const uint32_t *regs, const unsigned char count) {
+	const unsigned short span = cores - core;
+	unsigned char i;
+	short cpu;
+
+	clearMsrCache();
+	if (!count || !span) {
+		return;
+	}
+	// Sized for the largest batch once, the io_uring registers it as its fixed buffer.
+	if (msrCache.values == NULL) {
+		msrCache.values = malloc(cores * MAX_BATCH_REGS * sizeof *msrCache.values);
+		if (msrCache.values == NULL) {
+			error("Could not allocate memory for the MSR batch.");
+		}
+	}
+	msrCache.firstCore = core;
+	memcpy(msrCache.regs, regs, count * sizeof *regs);
+	if (debug && !quiet) {
+		printf("DEBUG: Batch reading %d registers from %d CPU cores\n", count, selectedCount());
+	}
+	// The budget is accounted and --stats times per read, so their batches go through readMsr().
+	const unsigned char batched = (!msrBudget && !stats && useUring && uringReadMsrs(regs, count));
+	if (!batched) {
+		for (cpu = core; cpu < cores; cpu = nextCore(cpu + 1)) {
+			for (i = 0; i < count; i++) {
+				readMsr(cpu, regs[i], &msrCache.values[(cpu - core) * count + i]);
+			}
+		}
+	}
+	// Only set the count once filled, rwMsrReg() ignores the cache until then.
+	msrCache.count = count;
+}
+
+/**
+ * Drop the registers read by batchReadMsrs(), the value buffer is kept for the next batch.
+ */
+void clearMsrCache() {
+	msrCache.count = 0;
+}
+
+/**
+ * Set up the io_uring of batchReadMsrs(): map its rings, register a sparse fixed file
+ * table with a slot per core and msrCache.values as fixed buffer.
+ * @return unsigned char -> 1 if the ring can be used.
+ */
+unsigned char uringSetup() {
+	struct io_uring_params params;
+	struct iovec iov;
+	unsigned char *sqRing, *cqRing;
+	int *fds;
+
+	if (uring.fd != -1) {
+		return uring.fd >= 0;
+	}
+	uring.fd = -2;
+	memset(&params, 0, sizeof params);
+	const int ring = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring < 0) {
+		return 0;
+	}
+	sqRing = mmap(NULL, params.sq_off.array + params.sq_entries * sizeof(unsigned int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+	cqRing = mmap(NULL, params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+	uring.sqes = mmap(NULL, params.sq_entries * sizeof *uring.sqes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+	fds = malloc(cores * sizeof *fds);
+	uring.registered = calloc(cores, 1);
+	if (fds == NULL || uring.registered == NULL) {
+		error("Could not allocate memory for the io_uring MSR batch.");
+	}
+	// Files are registered when a core is first read, -1 leaves the slot empty.
+	memset(fds, 0xff, cores * sizeof *fds);
+	iov.iov_base = msrCache.values;
+	iov.iov_len = cores * MAX_BATCH_REGS * sizeof *msrCache.values;
+	if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || uring.sqes == MAP_FAILED ||
+		syscall(__NR_io_uring_register, ring, IORING_REGISTER_FILES, fds, cores) < 0 ||
+		syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+		// Closing the ring also drops the mappings made before the failure.
+		close(ring);
+		free(fds);
+		return 0;
+	}
+	free(fds);
+	uring.sqHead = (unsigned int *) (sqRing + params.sq_off.head);
+	uring.sqTail = (unsigned int *) (sqRing + params.sq_off.tail);
+	uring.sqArray = (unsigned int *) (sqRing + params.sq_off.array);
+	uring.sqMask = *(unsigned int *) (sqRing + params.sq_off.ring_mask);
+	uring.cqHead = (unsigned int *) (cqRing + params.cq_off.head);
+	uring.cqTail = (unsigned int *) (cqRing + params.cq_off.tail);
+	uring.cqMask = *(unsigned int *) (cqRing + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *) (cqRing + params.cq_off.cqes);
+	uring.entries = params.sq_entries;
+	uring.fd = ring;
+	return 1;
+}
+
+/**
+ * Queue reads of every register on every selected core into the io_uring, submit
+ * them in batches of up to the ring size and wait for all their completions.
+ * Nothing is left in flight when this returns, so a pread fallback can reuse the buffer.
+ * @param regs -> The registers to read.
+ * @param count -> Number of registers.
+ * @return unsigned char -> 1 on success, 0 if io_uring is not usable or a read failed.
+ */
+unsigned char uringReadMsrs(const uint32_t *regs, const unsigned char count) {
+	const unsigned int total = selectedCount() * count;
+	unsigned int queued = 0, done, submitted, tail;
+	unsigned char failed = 0;
+	short cpu = core;
+	int ret;
+
+	if (!uringSetup()) {
+		return 0;
+	}
+	for (cpu = core; cpu < cores; cpu = nextCore(cpu + 1)) {
+		if (!uring.registered[cpu]) {
+			int fd = msrFd(cpu, 1);
+			struct io_uring_files_update update = {(unsigned int) cpu, 0, (uintptr_t) &fd};
+			if (syscall(__NR_io_uring_register, uring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+				return 0;
+			}
+			uring.registered[cpu] = 1;
+		}
+	}
+	cpu = core;
+	while (queued < total && !failed) {
+		const unsigned int head = *uring.sqHead;
+		tail = head;
+		for (; queued < total && tail - head < uring.entries; queued++, tail++) {
+			const unsigned int slot = tail & uring.sqMask;
+			struct io_uring_sqe *sqe = &uring.sqes[slot];
+			uint64_t *dest = &msrCache.values[(cpu - core) * count + queued % count];
+			memset(sqe, 0, sizeof *sqe);
+			sqe->opcode = IORING_OP_READ_FIXED;
+			sqe->flags = IOSQE_FIXED_FILE;
+			sqe->fd = cpu;
+			sqe->off = regs[queued % count];
+			sqe->addr = (uintptr_t) dest;
+			sqe->len = sizeof *dest;
+			sqe->buf_index = 0;
+			uring.sqArray[slot] = slot;
+			if (queued % count == count - 1u) {
+				cpu = nextCore(cpu + 1);
+			}
+		}
+		__atomic_store_n(uring.sqTail, tail, __ATOMIC_RELEASE);
+		// The kernel moves the SQ head past every entry it took, those are the ones in flight.
+		while (__atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE) != tail) {
+			ret = syscall(__NR_io_uring_enter, uring.fd, tail - *uring.sqHead, 0, 0, NULL, 0);
+			if (!ret || (ret < 0 && errno != EINTR)) {
+				break;
+			}
+		}
+		submitted = __atomic_load_n(uring.sqHead, __ATOMIC_ACQUIRE) - head;
+		if (submitted != tail - head) {
+			// Take back what the kernel refused, it must not be submitted with the next batch.
+			__atomic_store_n(uring.sqTail, head + submitted, __ATOMIC_RELEASE);
+			failed = 1;
+		}
+		for (done = 0; done < submitted;) {
+			unsigned int cqHead = *uring.cqHead;
+			if (cqHead == __atomic_load_n(uring.cqTail, __ATOMIC_ACQUIRE)) {
+				ret = syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+				if (ret < 0 && errno != EINTR) {
+					error("Lost track of io_uring MSR reads in flight.");
+				}
+				continue;
+			}
+			// A failed read makes the whole batch fall back to pread, which reports the error.
+			if (uring.cqes[cqHead & uring.cqMask].res != 8) {
+				failed = 1;
+			}
+			__atomic_store_n(uring.cqHead, cqHead + 1, __ATOMIC_RELEASE);
+			done++;
+		}
+	}
+	if (failed && debug && !quiet) {
+		printf("DEBUG: io_uring batch failed, falling back to pread\n");
+	}
+	return !failed;
+}
+
+/**
+ * Time full register sweeps (limit, status, every P-State and current state register
+ * of all selected cores) with pread and with io_uring, print the average of each.
+ */
+void benchmarkSweep() {
+	uint32_t regs[MAX_BATCH_REGS];
+	unsigned char count = 0, backend, i;
+	uint64_t start, elapsed;
+	unsigned int run;
+
+	regs[count++] = MSR_PSTATE_CURRENT_LIMIT;
+	regs[count++] = MSR_PSTATE_STATUS;
+	for (i = 0; i < PSTATES; i++) {
+		regs[count++] = MSR_PSTATE_BASE + i;
+	}
+	regs[count++] = currentStateReg();
+	batchReadMsrs(regs, count); // Opens the MSR devices outside of the timed runs.
+	for (backend = 0; backend < 2; backend++) {
+		useUring = backend;
+		if (backend && stats) {
+			printf("io_uring: not timed with --stats, which reads through pread\n");
+			break;
+		}
+		if (backend && !uringReadMsrs(regs, count)) {
+			printf("io_uring: not available\n");
+			break;
+		}
+		start = monotonicNs();
+		for (run = 0; run < benchSweeps; run++) {
+			batchReadMsrs(regs, count);
+		}
+		elapsed = monotonicNs() - start;
+		printf(
+			"%-8s %d sweeps of %d registers on %d cores: %.2fus per sweep\n",
+			backend ? "io_uring" : "pread", benchSweeps, count, selectedCount(), elapsed / 1000.0 / benchSweeps
+		);
+	}
+	clearMsrCache();
 }
 
 /**
@@ -789,6 +3660,7 @@ void rwPciReg(const char * loc, const uint32_t reg, const unsigned char read) {
 	char path[64];
 	int fh;
 
+	sprintf(path, "%.48s/00/%s", pciDir, loc);
 	if (debug && !quiet) {
 		printf("DEBUG: %sing data from PCI config space address %x at location %s\n", read ? "Read" : "Writ", reg, path);
 	}
@@ -797,14 +3669,17 @@ void rwPciReg(const char * loc, const uint32_t reg, const unsigned char read) {
 		return;
 	}
 
-	sprintf(path, "/proc/bus/pci/00/%s", loc);
 	fh = open(path, read ? O_RDONLY : O_WRONLY);
 	if (fh < 0) {
 		fprintf(stderr, "ERROR: Could not open PCI config space for %sing!\n", read ? "read" : "writ");
 		exit(EXIT_FAILURE);
 	}
 
+	const unsigned char phase = stats ? statsEnter(PHASE_PCI) : 0;
 	ssize_t psize = read ? pread(fh, &buffer, 8, reg) : pwrite(fh, &buffer, sizeof buffer, reg);
+	if (stats) {
+		statsLeave(phase, -1, 1);
+	}
 	close(fh);
 	if (psize != sizeof buffer) {
 		fprintf(stderr, "ERROR: Could not %s data from PCI config space!\n", read ? "read" : "write");
@@ -812,6 +3687,292 @@ void rwPciReg(const char * loc, const uint32_t reg, const unsigned char read) {
 	}
 }
 
+/**
+ * Sets the package power limits passed with --ppt, --tdc and --edc through the SMU mailbox
+ * and prints the limits against the current values, read from the SMU power table.
+ * Only the SMU of the first socket is reached through root complex 00:00.0.
+ */
+void smuPowerLimits() {
+	const smuMailbox *smu = smuFind();
+	uint32_t args[SMU_ARGS], rsp;
+	float limits[LIMITS], values[LIMITS];
+	unsigned char i;
+
+	if (smu == NULL) {
+		fprintf(stderr, "ERROR: Power limits are not supported on CPU model %xh from family %xh.\n", cpuModel, cpuFamily);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < LIMITS; i++) {
+		if (newLimits[i] < 0) {
+			continue;
+		}
+		if (!quiet) {
+			printf("%s limit set to %d%s%s.\n", LIMIT_NAMES[i], newLimits[i], LIMIT_UNITS[i], testMode ? " (preview, not changed)" : "");
+		}
+		if (testMode) {
+			continue;
+		}
+		// The SMU takes milliwatts and milliamps.
+		memset(args, 0, sizeof args);
+		args[0] = newLimits[i] * 1000;
+		rsp = smuCommand(smu, smu->setLimit[i], args);
+		if (rsp != SMU_RSP_OK) {
+			fprintf(stderr, "ERROR: The SMU refused the %s limit (response 0x%02x).\n", LIMIT_NAMES[i], rsp);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (!powerLimits || quiet) {
+		return;
+	}
+	if (!readPmTable(smu, limits, values)) {
+		error("Could not read the SMU power table.");
+	}
+	printf("\nSMU (%s) power limits of socket 0:\n", smu->name);
+	printf("        Current      Limit\n");
+	for (i = 0; i < LIMITS; i++) {
+		printf("%5s %9.2f%s %9.2f%s\n", LIMIT_NAMES[i], values[i], LIMIT_UNITS[i], limits[i], LIMIT_UNITS[i]);
+	}
+}
+
+/**
+ * Finds the SMU mailbox of the detected CPU.
+ * @return The mailbox, NULL if the CPU model has none amdctl knows.
+ */
+const smuMailbox *smuFind() {
+	unsigned char i;
+	for (i = 0; i < sizeof SMU_MAILBOXES / sizeof SMU_MAILBOXES[0]; i++) {
+		if (SMU_MAILBOXES[i].family == cpuFamily && SMU_MAILBOXES[i].model == cpuModel) {
+			return &SMU_MAILBOXES[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Finds a loaded kernel driver using the SMN index / data registers. The kernel serialises
+ * their accesses in amd_nb but not against ours, interleaved accesses reach the wrong registers.
+ * @return The driver name, NULL if none is loaded.
+ */
+const char *smnDriver() {
+	static const char *DRIVERS[] = {"k10temp", "amd_pmc", "amd64_edac"};
+	char path[64];
+	unsigned char i;
+
+	for (i = 0; i < sizeof DRIVERS / sizeof DRIVERS[0]; i++) {
+		sprintf(path, "/sys/module/%s", DRIVERS[i]);
+		if (access(path, F_OK) == 0) {
+			return DRIVERS[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Read or write a 32 bit system management network (SMN) register, by writing its
+ * address to the index register of the root complex and accessing the data register.
+ * Refuses to run while a driver that uses the same registers is loaded, unless --force-smn.
+ * With --smu-sim the registers are read and written at their address in that file.
+ * @param addr  -> SMN address.
+ * @param value -> Value to write.
+ * @param read  -> 1 to read, 0 to write.
+ * @return The value read.
+ */
+uint32_t smnRw(const uint32_t addr, const uint32_t value, const unsigned char read) {
+	static int fh = -1;
+	uint32_t data = value;
+
+	if (fh < 0) {
+		char path[64];
+		const char *driver = (forceSmn || smuSim != NULL || strcmp(pciDir, "/proc/bus/pci")) ? NULL : smnDriver();
+		if (driver != NULL) {
+			fprintf(stderr, "ERROR: The %s driver also uses the SMN index / data registers, unload it first (modprobe -r %s) or set --force-smn.\n", driver, driver);
+			exit(EXIT_FAILURE);
+		}
+		if (smuSim != NULL) {
+			snprintf(path, sizeof path, "%s", smuSim);
+			fh = open(path, O_RDWR | O_CREAT, 0644);
+		} else {
+			sprintf(path, "%.48s/00/%s", pciDir, ADDR_ROOT_COMPLEX);
+			fh = open(path, O_RDWR);
+		}
+		if (fh < 0) {
+			fprintf(stderr, "ERROR: Could not open %s for SMN access!\n", path);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (debug && !quiet) {
+		printf("DEBUG: %sing SMN address 0x%08x\n", read ? "Read" : "Writ", addr);
+	}
+	const unsigned char phase = stats ? statsEnter(PHASE_PCI) : 0;
+	if (smuSim != NULL) {
+		// A register never written reads as 0, like an idle mailbox.
+		if (read ? pread(fh, &data, sizeof data, addr) < 0 : pwrite(fh, &data, sizeof data, addr) != sizeof data) {
+			fprintf(stderr, "ERROR: Could not %s SMN address 0x%08x!\n", read ? "read" : "write", addr);
+			exit(EXIT_FAILURE);
+		}
+	} else if (pwrite(fh, &addr, sizeof addr, SMN_INDEX_REG) != sizeof addr ||
+		(read ? pread(fh, &data, sizeof data, SMN_DATA_REG) : pwrite(fh, &data, sizeof data, SMN_DATA_REG)) != sizeof data
+	) {
+		fprintf(stderr, "ERROR: Could not %s SMN address 0x%08x!\n", read ? "read" : "write", addr);
+		exit(EXIT_FAILURE);
+	}
+	if (stats) {
+		statsLeave(phase, -1, 1);
+	}
+	return data;
+}
+
+/**
+ * Send a message to the SMU mailbox and wait for its response.
+ * @param smu  -> The mailbox.
+ * @param msg  -> Message ID.
+ * @param args -> SMU_ARGS arguments, replaced with the values the SMU returns.
+ * @return The SMU response, SMU_RSP_OK on success.
+ */
+uint32_t smuCommand(const smuMailbox *smu, const unsigned char msg, uint32_t *args) {
+	const uint64_t deadline = monotonicNs() + SMU_TIMEOUT_NS;
+	uint32_t rsp;
+	unsigned char i;
+
+	// A new simulated SMU has not answered a message yet, it is idle.
+	if (smuSim != NULL && !smnRw(smu->rspReg, 0, 1)) {
+		smnRw(smu->rspReg, SMU_RSP_OK, 0);
+	}
+	// A previous message (from amdctl or a driver) has to be answered before sending ours.
+	while (!smnRw(smu->rspReg, 0, 1)) {
+		if (monotonicNs() > deadline) {
+			error("The SMU mailbox is busy.");
+		}
+	}
+	smnRw(smu->rspReg, 0, 0);
+	for (i = 0; i < SMU_ARGS; i++) {
+		smnRw(smu->argReg + i * 4, args[i], 0);
+	}
+	smnRw(smu->cmdReg, msg, 0);
+	if (smuSim != NULL) {
+		smuSimulate(smu, msg);
+	}
+	while (!(rsp = smnRw(smu->rspReg, 0, 1))) {
+		if (monotonicNs() > deadline) {
+			fprintf(stderr, "ERROR: The SMU did not answer message 0x%02x.\n", msg);
+			exit(EXIT_FAILURE);
+		}
+	}
+	// The SMU never answers with other values, they come from a DIR/00/00.0 that does not
+	// emulate the index / data registers, or from an access interleaved with another one.
+	if (rsp != SMU_RSP_OK && rsp < SMU_RSP_FAILURES) {
+		fprintf(stderr, "ERROR: Response 0x%02x to SMU message 0x%02x is not from the SMU, the SMN index / data registers did not reach it.\n", rsp, msg);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < SMU_ARGS; i++) {
+		args[i] = smnRw(smu->argReg + i * 4, 0, 1);
+	}
+	return rsp;
+}
+
+/**
+ * Answer a message sent to the --smu-sim SMU, like the firmware would. Its power table is at
+ * SMU_SIM_TABLE in the --mem-dev file, set limits are written there, current values are left
+ * to whatever the file holds.
+ * @param smu -> The mailbox.
+ * @param msg -> Message ID.
+ */
+void smuSimulate(const smuMailbox *smu, const unsigned char msg) {
+	uint32_t args[SMU_ARGS], rsp = SMU_RSP_OK;
+	unsigned char i;
+	float limit;
+	int fh;
+
+	for (i = 0; i < SMU_ARGS; i++) {
+		args[i] = smnRw(smu->argReg + i * 4, 0, 1);
+	}
+	fh = open(memDev, O_RDWR | O_CREAT, 0644);
+	// readPmTable() maps PM_TABLE_MAP bytes from the page of the table.
+	if (fh < 0 || ftruncate(fh, SMU_SIM_TABLE + PM_TABLE_MAP) != 0) {
+		fprintf(stderr, "ERROR: Could not open %s for the simulated SMU power table!\n", memDev);
+		exit(EXIT_FAILURE);
+	}
+	if (msg == smu->tableBase) {
+		args[0] = SMU_SIM_TABLE;
+		args[1] = 0;
+	} else if (msg != smu->tableToDram) {
+		for (i = 0; i < LIMITS && msg != smu->setLimit[i]; i++);
+		if (i == LIMITS) {
+			rsp = 0xfe; // Unknown message.
+		} else {
+			limit = args[0] / 1000.0f;
+			if (pwrite(fh, &limit, sizeof limit, SMU_SIM_TABLE + smu->tableOffset[i]) != sizeof limit) {
+				error("Could not write the simulated SMU power table.");
+			}
+		}
+	}
+	close(fh);
+	for (i = 0; i < SMU_ARGS; i++) {
+		smnRw(smu->argReg + i * 4, args[i], 0);
+	}
+	smnRw(smu->rspReg, rsp, 0);
+}
+
+/**
+ * Have the SMU copy its power table to DRAM and read the limits and current values from it.
+ * @param smu    -> The mailbox.
+ * @param limits -> LIMITS values set to the limits.
+ * @param values -> LIMITS values set to the current values.
+ * @return 1 on success, 0 if the table could not be read.
+ */
+unsigned char readPmTable(const smuMailbox *smu, float *limits, float *values) {
+	uint32_t args[SMU_ARGS] = {0};
+	uint64_t base;
+	unsigned char i;
+	float *table;
+	int fh;
+
+	if (smuCommand(smu, smu->tableBase, args) != SMU_RSP_OK) {
+		return 0;
+	}
+	base = args[0] | ((uint64_t) args[1] << 32);
+	memset(args, 0, sizeof args);
+	if (!base || smuCommand(smu, smu->tableToDram, args) != SMU_RSP_OK) {
+		return 0;
+	}
+	fh = open(memDev, O_RDONLY);
+	if (fh < 0) {
+		return 0;
+	}
+	table = mmap(NULL, PM_TABLE_MAP, PROT_READ, MAP_SHARED, fh, base & ~(uint64_t) (PM_TABLE_PAGE - 1));
+	close(fh);
+	if (table == MAP_FAILED) {
+		return 0;
+	}
+	for (i = 0; i < LIMITS; i++) {
+		limits[i] = *(volatile float *) ((char *) table + (base & (PM_TABLE_PAGE - 1)) + smu->tableOffset[i]);
+		values[i] = *(volatile float *) ((char *) table + (base & (PM_TABLE_PAGE - 1)) + smu->tableOffset[i] + 4);
+	}
+	munmap(table, PM_TABLE_MAP);
+	return 1;
+}
+
+/**
+ * Set the P-State fields passed with -a, -n, -v, -f and -d in the buffer variable.
+ */
+void applyPstateOptions() {
+	if (togglePs > -1) {
+		updateBuffer(PSTATE_EN_BITS, togglePs);
+	}
+	if (nbVid > -1) {
+		updateBuffer(NB_VID_BITS, nbVid);
+	}
+	if (cpuVid > -1) {
+		updateBuffer(CPU_VID_BITS, cpuVid);
+	}
+	if (cpuFid > -1) {
+		updateBuffer(CPU_FID_BITS, cpuFid);
+	}
+	if (cpuDid > -1) {
+		updateBuffer(CPU_DID_BITS, cpuDid);
+	}
+}
+
 /**
  * Modify buffer variable with replacement data at specified location.
  * @param loc -> Location in the buffer to overwrite data.
@@ -827,8 +3988,12 @@ void updateBuffer(const char *loc, const int replacement) {
 		} else {
 			buffer &= ~(1ULL << high);
 		}
-	} else if (replacement < (2 << (high - low))) {
-		buffer = (buffer & ((1 << low) - (2 << high) - 1)) | (replacement << low);
+	} else {
+		// 64 bit, a field can end at bit 31 or above.
+		const uint64_t max = ~0ULL >> (63 - (high - low));
+		if (replacement >= 0 && (uint64_t) replacement <= max) {
+			buffer = (buffer & ~(max << low)) | ((uint64_t) replacement << low);
+		}
 	}
 }
 